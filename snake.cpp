@@ -4,311 +4,3420 @@
  */
 
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <string>
 #include <sstream>
+#include <iomanip>
+#include <new>
+#include <chrono>
+#include <atomic>
+#include <thread>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SNAKE_X86_KERNELS 1
+#endif
 
 #ifdef _WIN32
 #include <conio.h>
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <termios.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
 #endif
 
 using namespace std;
 
-// Game constants
-const int WIDTH = 50;
-const int HEIGHT = 25;
+// Default board size. Override at build time with -DSNAKE_WIDTH=... and
+// -DSNAKE_HEIGHT=..., or at run time with --size WxH.
+#ifndef SNAKE_WIDTH
+#define SNAKE_WIDTH 50
+#endif
+#ifndef SNAKE_HEIGHT
+#define SNAKE_HEIGHT 25
+#endif
+
+const int DEFAULT_WIDTH = SNAKE_WIDTH;
+const int DEFAULT_HEIGHT = SNAKE_HEIGHT;
+const int MIN_BOARD_SIZE = 10;
+const int MAX_BOARD_SIZE = 8192;
+
+// Game state
+struct Point {
+    int x, y;
+    Point(int x = 0, int y = 0) : x(x), y(y) {}
+    bool operator==(const Point& other) const {
+        return x == other.x && y == other.y;
+    }
+};
+
+/**
+ * PCG32 random number generator (pcg-random.org): 64 bits of state, fast,
+ * and good in every output bit. Each game owns one, seeded explicitly, so
+ * games are reproducible and never share hidden state across threads.
+ */
+struct Rng {
+    uint64_t state = 0;
+    uint64_t inc = 1;
+
+    explicit Rng(uint64_t seed = 0, uint64_t stream = 0) { reseed(seed, stream); }
+
+    void reseed(uint64_t seed, uint64_t stream = 0) {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t shifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        uint32_t rot = static_cast<uint32_t>(old >> 59);
+        return (shifted >> rot) | (shifted << ((32 - rot) & 31));
+    }
+
+    // Uniform in [0, bound) with no modulo bias (Lemire's multiply-shift,
+    // retrying only in the rare biased zone)
+    uint32_t below(uint32_t bound) {
+        uint64_t m = static_cast<uint64_t>(next()) * bound;
+        uint32_t low = static_cast<uint32_t>(m);
+        if (low < bound) {
+            uint32_t threshold = (0u - bound) % bound;
+            while (low < threshold) {
+                m = static_cast<uint64_t>(next()) * bound;
+                low = static_cast<uint32_t>(m);
+            }
+        }
+        return static_cast<uint32_t>(m >> 32);
+    }
+};
+
+/**
+ * Board dimensions known only at run time
+ */
+struct DynamicBoard {
+    int width, height;
+    DynamicBoard(int width, int height) : width(width), height(height) {}
+};
+
+/**
+ * Board dimensions fixed at compile time, so index math and loop bounds in
+ * the hot paths fold to constants
+ */
+template <int W, int H>
+struct FixedBoard {
+    static const int width = W;
+    static const int height = H;
+};
+
+/**
+ * Call fn with the fastest board type for the given size: a FixedBoard for
+ * the common sizes, a DynamicBoard for everything else
+ */
+template <class Fn>
+typename Fn::result_type with_board(int width, int height, const Fn& fn) {
+    if (width == SNAKE_WIDTH && height == SNAKE_HEIGHT) {
+        return fn(FixedBoard<SNAKE_WIDTH, SNAKE_HEIGHT>());
+    }
+    if (width == 50 && height == 25) return fn(FixedBoard<50, 25>());
+    if (width == 100 && height == 50) return fn(FixedBoard<100, 50>());
+    if (width == 200 && height == 200) return fn(FixedBoard<200, 200>());
+    return fn(DynamicBoard(width, height));
+}
+
+/**
+ * Bump allocator for whole generations of game states: a search tree's
+ * clones, a batch of games. Allocation is a pointer bump inside a large
+ * block; nothing is freed one at a time, and reset() rewinds every block in
+ * O(1) so the next generation reuses the same memory without touching
+ * malloc. Anything allocated from the arena dies with the reset.
+ */
+struct Arena {
+    struct Block {
+        char* data;
+        size_t size;
+    };
+    vector<Block> blocks;
+    size_t block_size;
+    size_t current = 0;             // Block being bumped through
+    size_t offset = 0;              // Bytes used in it
+    
+    // Counters
+    uint64_t allocations = 0;       // Requests served
+    uint64_t bytes = 0;             // Bytes handed out, padding included
+    uint64_t block_allocations = 0; // Times the arena itself went to malloc
+    uint64_t resets = 0;
+    
+    explicit Arena(size_t block_size = 1 << 20) : block_size(block_size) {}
+    ~Arena() {
+        for (size_t i = 0; i < blocks.size(); i++) free(blocks[i].data);
+    }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    
+    void* allocate(size_t size, size_t align) {
+        allocations++;
+        while (true) {
+            if (current < blocks.size()) {
+                size_t start = (offset + align - 1) & ~(align - 1);
+                if (start + size <= blocks[current].size) {
+                    bytes += start + size - offset;
+                    offset = start + size;
+                    return blocks[current].data + start;
+                }
+                if (current + 1 < blocks.size() && blocks[current + 1].size >= size) {
+                    current++;
+                    offset = 0;
+                    continue;
+                }
+            }
+            // Out of blocks that fit: add one after the current block
+            Block block;
+            block.size = max(block_size, size);
+            block.data = static_cast<char*>(malloc(block.size));
+            if (!block.data) throw bad_alloc();
+            block_allocations++;
+            size_t at = blocks.empty() ? 0 : current + 1;
+            blocks.insert(blocks.begin() + at, block);
+            current = at;
+            offset = 0;
+        }
+    }
+    
+    void reset() {
+        current = 0;
+        offset = 0;
+        resets++;
+    }
+};
+
+// Allocations that went to the heap through an ArenaAllocator with no
+// arena, i.e. every game state not built in an arena
+atomic<uint64_t> heap_allocations(0);
+
+/**
+ * Standard allocator that takes its memory from an Arena, or from the
+ * heap when it has none. Containers copied from an arena-backed one stay
+ * in the same arena, so cloning a state in a search allocates nothing
+ * from the heap.
+ */
+template <class T>
+struct ArenaAllocator {
+    typedef T value_type;
+    Arena* arena;
+    
+    ArenaAllocator(Arena* arena = NULL) : arena(arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+    
+    T* allocate(size_t n) {
+        if (arena) return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+        heap_allocations.fetch_add(1, memory_order_relaxed);
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t) {
+        if (!arena) ::operator delete(p);
+    }
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena == b.arena; }
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+// Direction codes: 0 up, 1 right, 2 down, 3 left
+const int DIR_DX[4] = {0, 1, 0, -1};
+const int DIR_DY[4] = {-1, 0, 1, 0};
+
+/** Is (x, y) inside the border wall, where the snake may go? */
+inline bool on_playfield(int x, int y, int width, int height) {
+    return x > 0 && x < width - 1 && y > 0 && y < height - 1;
+}
+
+/**
+ * Ring buffer holding the snake body, head first, sized for the whole
+ * board. Growing at the head and shrinking at the tail are both O(1), and
+ * an occupancy grid kept alongside answers "is this cell snake?" in one
+ * lookup. Cells are indexed y * width + x.
+ */
+struct SnakeBody {
+    vector<Point, ArenaAllocator<Point> > cells;
+    vector<unsigned char, ArenaAllocator<unsigned char> > occupied;
+    int width = 0;
+    int capacity = 0;
+    int head = 0;
+    int length = 0;
+    
+    explicit SnakeBody(Arena* arena = NULL) : cells(arena), occupied(arena) {}
+    SnakeBody(const SnakeBody& other, Arena* arena)
+        : cells(other.cells, arena), occupied(other.occupied, arena), width(other.width),
+          capacity(other.capacity), head(other.head), length(other.length) {}
+
+    void resize(int board_width, int board_height) {
+        width = board_width;
+        capacity = board_width * board_height;
+        cells.assign(capacity, Point());
+        occupied.assign(capacity, 0);
+        head = 0;
+        length = 0;
+    }
+
+    void clear() {
+        while (length > 0) {
+            const Point& tail = back();
+            pop_back(tail.y * width + tail.x);
+        }
+        head = 0;
+    }
+
+    size_t size() const { return length; }
+    
+    const Point& front() const { return cells[head]; }
+
+    Point& operator[](size_t i) {
+        int index = head + static_cast<int>(i);
+        return cells[index >= capacity ? index - capacity : index];
+    }
+    
+    const Point& operator[](size_t i) const {
+        int index = head + static_cast<int>(i);
+        return cells[index >= capacity ? index - capacity : index];
+    }
+
+    const Point& back() { return (*this)[length - 1]; }
+
+    void push_front(const Point& p, int cell) {
+        head = (head == 0 ? capacity : head) - 1;
+        cells[head] = p;
+        occupied[cell] = 1;
+        length++;
+    }
+
+    void push_back(const Point& p, int cell) {
+        length++;
+        (*this)[length - 1] = p;
+        occupied[cell] = 1;
+    }
+
+    // tail_cell is the cell index of back()
+    void pop_back(int tail_cell) {
+        occupied[tail_cell] = 0;
+        length--;
+    }
+
+    bool occupies(int cell) const { return occupied[cell] != 0; }
+    bool occupies(const Point& p) const { return occupies(p.y * width + p.x); }
+};
+
+/**
+ * Cells food may spawn on (two in from the border) that the snake does not
+ * cover. Dense array plus position map: add, remove and uniform sampling
+ * are all O(1).
+ */
+struct FreeCells {
+    enum {
+        ABSENT = -1,   // Food cell currently under the snake
+        NEVER = -2     // Too close to the border for food
+    };
+
+    vector<int, ArenaAllocator<int> > cells;
+    vector<int, ArenaAllocator<int> > position;
+    int count = 0;
+    
+    explicit FreeCells(Arena* arena = NULL) : cells(arena), position(arena) {}
+    FreeCells(const FreeCells& other, Arena* arena)
+        : cells(other.cells, arena), position(other.position, arena), count(other.count) {}
+
+    void reset(int width, int height) {
+        cells.resize(width * height);
+        position.assign(width * height, NEVER);
+        count = 0;
+        for (int y = 2; y <= height - 3; y++) {
+            for (int x = 2; x <= width - 3; x++) {
+                position[y * width + x] = ABSENT;
+                add(y * width + x);
+            }
+        }
+    }
+
+    void add(int cell) {
+        if (position[cell] != ABSENT) return;
+        position[cell] = count;
+        cells[count++] = cell;
+    }
+
+    void remove(int cell) {
+        int pos = position[cell];
+        if (pos < 0) return;
+        int last = cells[--count];
+        cells[pos] = last;
+        position[last] = pos;
+        position[cell] = ABSENT;
+    }
+
+    int sample(Rng& rng) const {
+        return cells[rng.below(count)];
+    }
+};
+
+/**
+ * Outcome of one simulation tick
+ */
+enum StepResult {
+    STEP_IDLE,    // Game already over, nothing happened
+    STEP_MOVED,
+    STEP_ATE,
+    STEP_DIED,
+    STEP_WON      // Ate the last piece of food the board had room for
+};
+
+/**
+ * Everything one game needs to run. No globals and no I/O, so a process
+ * can hold and step as many independent games as it likes.
+ */
+struct GameState {
+    int width;
+    int height;
+    SnakeBody snake;
+    FreeCells free_cells;
+    Point food;
+    Rng rng;                 // Food placement
+    int score = 0;
+    char direction = 'w';
+    char next_direction = 'w';
+    bool game_over = false;
+    bool game_won = false;
+
+    /** Storage comes from arena if given, otherwise from the heap */
+    explicit GameState(int width = DEFAULT_WIDTH, int height = DEFAULT_HEIGHT, Arena* arena = NULL)
+        : width(width), height(height), snake(arena), free_cells(arena) {
+        snake.resize(width, height);
+        free_cells.reset(width, height);
+    }
+    
+    /** Copy of other with its storage in arena */
+    GameState(const GameState& other, Arena* arena)
+        : width(other.width), height(other.height), snake(other.snake, arena),
+          free_cells(other.free_cells, arena), food(other.food), rng(other.rng),
+          score(other.score), direction(other.direction), next_direction(other.next_direction),
+          game_over(other.game_over), game_won(other.game_won) {}
+};
+
+/**
+ * Snake body for very large boards, at 3 bits a cell: a 2-bit grid holding,
+ * for every segment but the head, the direction code of the next segment
+ * toward the head, plus a 1-bit occupancy grid. With the head and tail
+ * kept as points, growing at the head and shrinking at the tail are O(1)
+ * like the ring buffer, but segments can't be indexed; only the two ends
+ * are known without walking the body.
+ */
+struct PackedSnakeBody {
+    vector<uint64_t> links;       // 2 bits per cell, 32 cells a word
+    vector<uint64_t> occupied;    // 1 bit per cell, 64 cells a word
+    int width = 0;
+    int length = 0;
+    Point head;
+    Point tail;
+    
+    void resize(int board_width, int board_height) {
+        width = board_width;
+        size_t cells = static_cast<size_t>(board_width) * board_height;
+        links.assign((cells + 31) / 32, 0);
+        occupied.assign((cells + 63) / 64, 0);
+        length = 0;
+    }
+    
+    void clear() {
+        while (length > 0) pop_back(tail.y * width + tail.x);
+    }
+    
+    size_t size() const { return length; }
+    const Point& front() const { return head; }
+    const Point& back() const { return tail; }
+    
+    bool occupies(int cell) const {
+        return (occupied[cell >> 6] >> (cell & 63)) & 1;
+    }
+    
+    int link(int cell) const {
+        return static_cast<int>(links[cell >> 5] >> ((cell & 31) * 2)) & 3;
+    }
+    
+    void set_link(int cell, int code) {
+        uint64_t& word = links[cell >> 5];
+        int shift = (cell & 31) * 2;
+        word = (word & ~(3ULL << shift)) | (static_cast<uint64_t>(code) << shift);
+    }
+    
+    static int step_code(const Point& from, const Point& to) {
+        return to.x > from.x ? 1 : to.x < from.x ? 3 : to.y > from.y ? 2 : 0;
+    }
+    
+    void push_front(const Point& p, int cell) {
+        if (length == 0) {
+            tail = p;
+        } else {
+            set_link(head.y * width + head.x, step_code(head, p));
+        }
+        head = p;
+        occupied[cell >> 6] |= 1ULL << (cell & 63);
+        length++;
+    }
+    
+    void push_back(const Point& p, int cell) {
+        if (length == 0) {
+            head = p;
+        } else {
+            set_link(cell, step_code(p, tail));
+        }
+        tail = p;
+        occupied[cell >> 6] |= 1ULL << (cell & 63);
+        length++;
+    }
+    
+    // tail_cell is the cell index of back()
+    void pop_back(int tail_cell) {
+        occupied[tail_cell >> 6] &= ~(1ULL << (tail_cell & 63));
+        length--;
+        if (length > 0) {
+            int code = link(tail_cell);
+            tail.x += DIR_DX[code];
+            tail.y += DIR_DY[code];
+        }
+    }
+};
+
+/**
+ * Free food cells at 1 bit a cell, for very large boards. Sampling tries
+ * random cells of the food area first, which takes a few tries unless the
+ * board is nearly full, then falls back to counting set bits word by word
+ * to the chosen one. Uniform like FreeCells, but draws from the RNG
+ * differently, so the same seed places food elsewhere.
+ */
+struct PackedFreeCells {
+    vector<uint64_t> bits;        // Set: food may go here
+    int width = 0;
+    int height = 0;
+    int count = 0;
+    
+    void reset(int board_width, int board_height) {
+        width = board_width;
+        height = board_height;
+        bits.assign((static_cast<size_t>(width) * height + 63) / 64, 0);
+        count = 0;
+        for (int y = 2; y <= height - 3; y++) {
+            for (int x = 2; x <= width - 3; x++) add(y * width + x);
+        }
+    }
+    
+    bool contains(int cell) const {
+        return (bits[cell >> 6] >> (cell & 63)) & 1;
+    }
+    
+    void add(int cell) {
+        int x = cell % width;
+        int y = cell / width;
+        if (x < 2 || x > width - 3 || y < 2 || y > height - 3 || contains(cell)) return;
+        bits[cell >> 6] |= 1ULL << (cell & 63);
+        count++;
+    }
+    
+    void remove(int cell) {
+        if (!contains(cell)) return;
+        bits[cell >> 6] &= ~(1ULL << (cell & 63));
+        count--;
+    }
+    
+    int sample(Rng& rng) const {
+        for (int attempt = 0; attempt < 16; attempt++) {
+            int x = 2 + static_cast<int>(rng.below(width - 4));
+            int y = 2 + static_cast<int>(rng.below(height - 4));
+            if (contains(y * width + x)) return y * width + x;
+        }
+        uint32_t k = rng.below(count);
+        for (size_t w = 0; ; w++) {
+            uint32_t in_word = static_cast<uint32_t>(__builtin_popcountll(bits[w]));
+            if (k < in_word) {
+                uint64_t word = bits[w];
+                for (; k > 0; k--) word &= word - 1;   // Drop the lowest k set bits
+                return static_cast<int>(w * 64 + __builtin_ctzll(word));
+            }
+            k -= in_word;
+        }
+    }
+};
+
+/**
+ * A game for boards too big for GameState: the same rules through the
+ * same step_on(), in about half a byte per cell where GameState takes 17
+ * (8 for the ring buffer's points, 1 for occupancy, 8 for the free-cell
+ * index). A 4096x4096 board is 8 MB instead of 285 MB.
+ */
+struct PackedGameState {
+    int width;
+    int height;
+    PackedSnakeBody snake;
+    PackedFreeCells free_cells;
+    Point food;
+    Rng rng;
+    int score = 0;
+    char direction = 'w';
+    char next_direction = 'w';
+    bool game_over = false;
+    bool game_won = false;
+    
+    explicit PackedGameState(int width = DEFAULT_WIDTH, int height = DEFAULT_HEIGHT)
+        : width(width), height(height) {
+        snake.resize(width, height);
+        free_cells.reset(width, height);
+    }
+};
+
+/**
+ * Spawn food on a uniformly chosen free cell.
+ * Returns false when the snake has left no room for food.
+ */
+template <class State, class Board>
+bool spawn_food(State& state, const Board& board) {
+    if (state.free_cells.count == 0) return false;
+    int cell = state.free_cells.sample(state.rng);
+    state.food = Point(cell % board.width, cell / board.width);
+    return true;
+}
+
+bool spawn_food(GameState& state) {
+    return spawn_food(state, DynamicBoard(state.width, state.height));
+}
+
+/**
+ * Start a fresh game: three segments in the middle, heading up. The seed
+ * decides every food position, so the same seed and moves replay the
+ * same game.
+ */
+template <class State>
+void reset_game(State& state, uint64_t seed) {
+    state.rng.reseed(seed);
+    state.snake.clear();
+    state.free_cells.reset(state.width, state.height);
+    
+    int start_x = state.width / 2;
+    int start_y = state.height / 2;
+    
+    for (int i = 0; i < 3; i++) {
+        Point segment(start_x, start_y + i);
+        int cell = segment.y * state.width + segment.x;
+        state.snake.push_back(segment, cell);
+        state.free_cells.remove(cell);
+    }
+    
+    spawn_food(state, DynamicBoard(state.width, state.height));
+    
+    state.score = 0;
+    state.direction = 'w';
+    state.next_direction = 'w';
+    state.game_over = false;
+    state.game_won = false;
+}
+
+/**
+ * Queue a turn for the next tick. Reversing onto the body is ignored, as is
+ * anything that is not one of w/a/s/d.
+ */
+template <class State>
+void steer(State& state, char action) {
+    switch (action) {
+        case 'w': if (state.direction != 's') state.next_direction = 'w'; break;
+        case 's': if (state.direction != 'w') state.next_direction = 's'; break;
+        case 'a': if (state.direction != 'd') state.next_direction = 'a'; break;
+        case 'd': if (state.direction != 'a') state.next_direction = 'd'; break;
+    }
+}
+
+/**
+ * One tick on a board of known type; see step()
+ */
+template <class State, class Board>
+StepResult step_on(State& state, char action, const Board& board) {
+    if (state.game_over) return STEP_IDLE;
+    
+    steer(state, action);
+    state.direction = state.next_direction;
+    
+    Point new_head = state.snake.front();
+    
+    switch (state.direction) {
+        case 'w': new_head.y--; break;
+        case 's': new_head.y++; break;
+        case 'a': new_head.x--; break;
+        case 'd': new_head.x++; break;
+    }
+    
+    if (!on_playfield(new_head.x, new_head.y, board.width, board.height)) {
+        state.game_over = true;
+        return STEP_DIED;
+    }
+    
+    int head_cell = new_head.y * board.width + new_head.x;
+    if (state.snake.occupies(head_cell)) {
+        state.game_over = true;
+        return STEP_DIED;
+    }
+    
+    state.snake.push_front(new_head, head_cell);
+    state.free_cells.remove(head_cell);
+    
+    if (new_head == state.food) {
+        state.score += 10;
+        if (!spawn_food(state, board)) {
+            // Board is full: nowhere left to put food
+            state.game_over = true;
+            state.game_won = true;
+            return STEP_WON;
+        }
+        return STEP_ATE;
+    }
+    
+    const Point& tail = state.snake.back();
+    int tail_cell = tail.y * board.width + tail.x;
+    state.snake.pop_back(tail_cell);
+    state.free_cells.add(tail_cell);
+    return STEP_MOVED;
+}
+
+struct StepOnBoard {
+    typedef StepResult result_type;
+    GameState& state;
+    char action;
+    template <class Board>
+    StepResult operator()(const Board& board) const { return step_on(state, action, board); }
+};
+
+/**
+ * Advance one tick. action is a w/a/s/d turn, or 0 to keep the queued one.
+ */
+StepResult step(GameState& state, char action) {
+    StepOnBoard fn = {state, action};
+    return with_board(state.width, state.height, fn);
+}
+
+/**
+ * Advance a packed game one tick. Boards big enough to want one never have
+ * a FixedBoard, so this goes straight to the run-time size.
+ */
+StepResult step(PackedGameState& state, char action) {
+    return step_on(state, action, DynamicBoard(state.width, state.height));
+}
+
+/**
+ * Batched simulation
+ *
+ * Many games of the same board size stepped in lockstep, stored as
+ * structure-of-arrays so each per-game field is one contiguous run.
+ * Per-cell data (body ring, occupancy, free-cell index) sits in one slab
+ * per kind, game g's slice at g * cells.
+ *
+ * The rules match step(); directions are kept as codes 0-3 (up, right,
+ * down, left) so a reversal is (a ^ b) == 2.
+ *
+ * A tick runs in two passes. A move kernel handles the branch-free part for
+ * every game at once - apply the turn, compute the new head, flag wall,
+ * food and self hits - using AVX2 or SSE4.1 when the CPU has them. A
+ * scalar pass then commits the moves, which is where games diverge.
+ */
+/**
+ * Direction code for a w/a/s/d key, or -1
+ */
+inline int direction_code(char key) {
+    switch (key) {
+        case 'w': return 0;
+        case 'd': return 1;
+        case 's': return 2;
+        case 'a': return 3;
+        default:  return -1;
+    }
+}
+
+struct BatchGames;
+
+// Move kernel output flags
+const int MOVE_WALL = 1;
+const int MOVE_FOOD = 2;
+const int MOVE_SELF = 4;
+
+/**
+ * Computes next_x, next_y and move_flags for every game and applies the
+ * turns in actions to direction
+ */
+struct MoveKernel {
+    const char* name;
+    void (*run)(BatchGames& batch, const char* actions);
+};
+
+struct BatchGames {
+    int count = 0;
+    int width = 0;
+    int height = 0;
+    int cells = 0;
+
+    // One entry per game
+    vector<int> head_x;
+    vector<int> head_y;
+    vector<int> ring_head;            // Body ring slot holding the head
+    vector<int> length;
+    vector<int> direction;            // Direction code
+    vector<int> food_x;
+    vector<int> food_y;
+    vector<int> score;
+    vector<unsigned char> done;       // Game ended on the last step (and was reset)
+    vector<int> final_score;          // Its score when it ended
+    vector<int> free_count;
+    vector<Rng> rng;                  // Food placement, one stream per game
+
+    // Move kernel output, one entry per game
+    vector<int> next_x;
+    vector<int> next_y;
+    vector<int> move_flags;           // MOVE_* bits
+
+    // cells entries per game
+    vector<int> body;                 // Ring of cell indices, head first
+    vector<unsigned char> occupied;   // Plus 3 bytes of padding for 32-bit gathers
+    vector<int> free_cells;
+    vector<int> free_pos;             // FreeCells::ABSENT / NEVER, or index in free_cells
+
+    const MoveKernel* kernel = NULL;
+    long long games_finished = 0;
+};
+
+/**
+ * Put food for game g on a uniformly chosen free cell.
+ * Returns false when there is none.
+ */
+bool spawn_batch_food(BatchGames& batch, int g) {
+    int count = batch.free_count[g];
+    if (count == 0) return false;
+    int cell = batch.free_cells[static_cast<size_t>(g) * batch.cells + batch.rng[g].below(count)];
+    batch.food_x[g] = cell % batch.width;
+    batch.food_y[g] = cell / batch.width;
+    return true;
+}
+
+inline void batch_occupy(BatchGames& batch, int g, int cell) {
+    size_t base = static_cast<size_t>(g) * batch.cells;
+    batch.occupied[base + cell] = 1;
+    int pos = batch.free_pos[base + cell];
+    if (pos < 0) return;
+    int last = batch.free_cells[base + --batch.free_count[g]];
+    batch.free_cells[base + pos] = last;
+    batch.free_pos[base + last] = pos;
+    batch.free_pos[base + cell] = FreeCells::ABSENT;
+}
+
+inline void batch_vacate(BatchGames& batch, int g, int cell) {
+    size_t base = static_cast<size_t>(g) * batch.cells;
+    batch.occupied[base + cell] = 0;
+    if (batch.free_pos[base + cell] != FreeCells::ABSENT) return;
+    batch.free_pos[base + cell] = batch.free_count[g];
+    batch.free_cells[base + batch.free_count[g]++] = cell;
+}
+
+/**
+ * Start game g afresh, as reset_game() does. Only the cells the old snake
+ * covered are touched, so a reset costs O(length), not O(board).
+ */
+void reset_batch_game(BatchGames& batch, int g) {
+    size_t base = static_cast<size_t>(g) * batch.cells;
+    for (int i = 0; i < batch.length[g]; i++) {
+        int slot = batch.ring_head[g] + i;
+        if (slot >= batch.cells) slot -= batch.cells;
+        batch_vacate(batch, g, batch.body[base + slot]);
+    }
+    
+    int start_x = batch.width / 2;
+    int start_y = batch.height / 2;
+    batch.ring_head[g] = 0;
+    batch.length[g] = 3;
+    for (int i = 0; i < 3; i++) {
+        int cell = (start_y + i) * batch.width + start_x;
+        batch.body[base + i] = cell;
+        batch_occupy(batch, g, cell);
+    }
+    
+    batch.head_x[g] = start_x;
+    batch.head_y[g] = start_y;
+    batch.direction[g] = 0;
+    batch.score[g] = 0;
+    spawn_batch_food(batch, g);
+}
+
+/**
+ * Portable move kernel
+ */
+void classify_moves_scalar(BatchGames& batch, const char* actions, int begin, int end) {
+    for (int g = begin; g < end; g++) {
+        int dir = batch.direction[g];
+        int turn = direction_code(actions[g]);
+        if (turn >= 0 && (turn ^ dir) != 2) dir = turn;
+        batch.direction[g] = dir;
+        
+        int x = batch.head_x[g] + DIR_DX[dir];
+        int y = batch.head_y[g] + DIR_DY[dir];
+        int flags = 0;
+        if (!on_playfield(x, y, batch.width, batch.height)) {
+            flags |= MOVE_WALL;
+        } else if (batch.occupied[static_cast<size_t>(g) * batch.cells + y * batch.width + x]) {
+            flags |= MOVE_SELF;
+        }
+        if (x == batch.food_x[g] && y == batch.food_y[g]) flags |= MOVE_FOOD;
+        
+        batch.next_x[g] = x;
+        batch.next_y[g] = y;
+        batch.move_flags[g] = flags;
+    }
+}
+
+void classify_moves_scalar(BatchGames& batch, const char* actions) {
+    classify_moves_scalar(batch, actions, 0, batch.count);
+}
+
+#ifdef SNAKE_X86_KERNELS
+/**
+ * SSE4.1 move kernel: 4 games per vector. SSE has no gather, so
+ * occupancy is read lane by lane.
+ */
+__attribute__((target("sse4.1")))
+void classify_moves_sse41(BatchGames& batch, const char* actions) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i two = _mm_set1_epi32(2);
+    const __m128i three = _mm_set1_epi32(3);
+    const __m128i key_w = _mm_set1_epi32('w');
+    const __m128i key_d = _mm_set1_epi32('d');
+    const __m128i key_s = _mm_set1_epi32('s');
+    const __m128i key_a = _mm_set1_epi32('a');
+    const __m128i max_x = _mm_set1_epi32(batch.width - 2);
+    const __m128i max_y = _mm_set1_epi32(batch.height - 2);
+    const __m128i width = _mm_set1_epi32(batch.width);
+    const __m128i flag_wall = _mm_set1_epi32(MOVE_WALL);
+    const __m128i flag_food = _mm_set1_epi32(MOVE_FOOD);
+    
+    int g = 0;
+    for (; g + 4 <= batch.count; g += 4) {
+        int32_t action_bytes;
+        memcpy(&action_bytes, actions + g, 4);
+        __m128i action = _mm_cvtepi8_epi32(_mm_cvtsi32_si128(action_bytes));
+        __m128i dir = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&batch.direction[g]));
+        
+        // Turn code, or no turn if the key is not w/a/s/d or would reverse
+        __m128i is_w = _mm_cmpeq_epi32(action, key_w);
+        __m128i is_d = _mm_cmpeq_epi32(action, key_d);
+        __m128i is_s = _mm_cmpeq_epi32(action, key_s);
+        __m128i is_a = _mm_cmpeq_epi32(action, key_a);
+        __m128i turn = _mm_or_si128(_mm_and_si128(is_d, one),
+                       _mm_or_si128(_mm_and_si128(is_s, two), _mm_and_si128(is_a, three)));
+        __m128i valid = _mm_or_si128(_mm_or_si128(is_w, is_d), _mm_or_si128(is_s, is_a));
+        __m128i reverse = _mm_cmpeq_epi32(_mm_xor_si128(turn, dir), two);
+        dir = _mm_blendv_epi8(dir, turn, _mm_andnot_si128(reverse, valid));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&batch.direction[g]), dir);
+        
+        __m128i dx = _mm_sub_epi32(_mm_cmpeq_epi32(dir, three), _mm_cmpeq_epi32(dir, one));
+        __m128i dy = _mm_sub_epi32(_mm_cmpeq_epi32(dir, zero), _mm_cmpeq_epi32(dir, two));
+        __m128i x = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&batch.head_x[g])), dx);
+        __m128i y = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&batch.head_y[g])), dy);
+        
+        __m128i wall = _mm_or_si128(_mm_or_si128(_mm_cmpgt_epi32(one, x), _mm_cmpgt_epi32(x, max_x)),
+                                    _mm_or_si128(_mm_cmpgt_epi32(one, y), _mm_cmpgt_epi32(y, max_y)));
+        __m128i food = _mm_and_si128(
+            _mm_cmpeq_epi32(x, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&batch.food_x[g]))),
+            _mm_cmpeq_epi32(y, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&batch.food_y[g]))));
+        __m128i flags = _mm_or_si128(_mm_and_si128(wall, flag_wall), _mm_and_si128(food, flag_food));
+        
+        int32_t cell[4];
+        int32_t lane_flags[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(cell), _mm_add_epi32(_mm_mullo_epi32(y, width), x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lane_flags), flags);
+        for (int i = 0; i < 4; i++) {
+            if (!(lane_flags[i] & MOVE_WALL) &&
+                batch.occupied[static_cast<size_t>(g + i) * batch.cells + cell[i]]) {
+                lane_flags[i] |= MOVE_SELF;
+            }
+        }
+        
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&batch.next_x[g]), x);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&batch.next_y[g]), y);
+        memcpy(&batch.move_flags[g], lane_flags, sizeof(lane_flags));
+    }
+    classify_moves_scalar(batch, actions, g, batch.count);
+}
+
+/**
+ * AVX2 move kernel: 8 games per vector, occupancy fetched with a masked
+ * gather. Needs every slab index to fit in 32 bits (see move_kernels()).
+ */
+__attribute__((target("avx2")))
+void classify_moves_avx2(BatchGames& batch, const char* actions) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i two = _mm256_set1_epi32(2);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256i key_w = _mm256_set1_epi32('w');
+    const __m256i key_d = _mm256_set1_epi32('d');
+    const __m256i key_s = _mm256_set1_epi32('s');
+    const __m256i key_a = _mm256_set1_epi32('a');
+    const __m256i max_x = _mm256_set1_epi32(batch.width - 2);
+    const __m256i max_y = _mm256_set1_epi32(batch.height - 2);
+    const __m256i width = _mm256_set1_epi32(batch.width);
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    const __m256i flag_wall = _mm256_set1_epi32(MOVE_WALL);
+    const __m256i flag_food = _mm256_set1_epi32(MOVE_FOOD);
+    const __m256i flag_self = _mm256_set1_epi32(MOVE_SELF);
+    const __m256i lane_base = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                 _mm256_set1_epi32(batch.cells));
+    const int* occupied = reinterpret_cast<const int*>(batch.occupied.data());
+    
+    int g = 0;
+    for (; g + 8 <= batch.count; g += 8) {
+        __m256i action = _mm256_cvtepi8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(actions + g)));
+        __m256i dir = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&batch.direction[g]));
+        
+        // Turn code, or no turn if the key is not w/a/s/d or would reverse
+        __m256i is_w = _mm256_cmpeq_epi32(action, key_w);
+        __m256i is_d = _mm256_cmpeq_epi32(action, key_d);
+        __m256i is_s = _mm256_cmpeq_epi32(action, key_s);
+        __m256i is_a = _mm256_cmpeq_epi32(action, key_a);
+        __m256i turn = _mm256_or_si256(_mm256_and_si256(is_d, one),
+                       _mm256_or_si256(_mm256_and_si256(is_s, two), _mm256_and_si256(is_a, three)));
+        __m256i valid = _mm256_or_si256(_mm256_or_si256(is_w, is_d), _mm256_or_si256(is_s, is_a));
+        __m256i reverse = _mm256_cmpeq_epi32(_mm256_xor_si256(turn, dir), two);
+        dir = _mm256_blendv_epi8(dir, turn, _mm256_andnot_si256(reverse, valid));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&batch.direction[g]), dir);
+        
+        __m256i dx = _mm256_sub_epi32(_mm256_cmpeq_epi32(dir, three), _mm256_cmpeq_epi32(dir, one));
+        __m256i dy = _mm256_sub_epi32(_mm256_cmpeq_epi32(dir, zero), _mm256_cmpeq_epi32(dir, two));
+        __m256i x = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&batch.head_x[g])), dx);
+        __m256i y = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&batch.head_y[g])), dy);
+        
+        __m256i wall = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi32(one, x), _mm256_cmpgt_epi32(x, max_x)),
+            _mm256_or_si256(_mm256_cmpgt_epi32(one, y), _mm256_cmpgt_epi32(y, max_y)));
+        __m256i food = _mm256_and_si256(
+            _mm256_cmpeq_epi32(x, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&batch.food_x[g]))),
+            _mm256_cmpeq_epi32(y, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&batch.food_y[g]))));
+        
+        // Off-board lanes are masked out of the gather, so it never reads
+        // outside the slab
+        __m256i index = _mm256_add_epi32(_mm256_set1_epi32(g * batch.cells),
+                        _mm256_add_epi32(lane_base, _mm256_add_epi32(_mm256_mullo_epi32(y, width), x)));
+        __m256i on_board = _mm256_xor_si256(wall, _mm256_set1_epi32(-1));
+        __m256i occ = _mm256_and_si256(_mm256_mask_i32gather_epi32(zero, occupied, index, on_board, 1),
+                                       byte_mask);
+        __m256i self = _mm256_andnot_si256(_mm256_cmpeq_epi32(occ, zero), on_board);
+        
+        __m256i flags = _mm256_or_si256(_mm256_and_si256(wall, flag_wall),
+                        _mm256_or_si256(_mm256_and_si256(food, flag_food), _mm256_and_si256(self, flag_self)));
+        
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&batch.next_x[g]), x);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&batch.next_y[g]), y);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&batch.move_flags[g]), flags);
+    }
+    classify_moves_scalar(batch, actions, g, batch.count);
+}
+#endif
+
+const MoveKernel SCALAR_KERNEL = {"scalar", classify_moves_scalar};
+#ifdef SNAKE_X86_KERNELS
+const MoveKernel SSE41_KERNEL = {"sse4.1", classify_moves_sse41};
+const MoveKernel AVX2_KERNEL = {"avx2", classify_moves_avx2};
+#endif
+
+/**
+ * Move kernels this CPU can run for a batch of the given size, best first
+ */
+vector<const MoveKernel*> move_kernels(int count, int cells) {
+    vector<const MoveKernel*> kernels;
+#ifdef SNAKE_X86_KERNELS
+    __builtin_cpu_init();
+    long long slab = static_cast<long long>(count) * cells;
+    if (__builtin_cpu_supports("avx2") && slab < 0x7ffffff0LL) kernels.push_back(&AVX2_KERNEL);
+    if (__builtin_cpu_supports("sse4.1")) kernels.push_back(&SSE41_KERNEL);
+#else
+    (void)count;
+    (void)cells;
+#endif
+    kernels.push_back(&SCALAR_KERNEL);
+    return kernels;
+}
+
+/**
+ * Allocate and start count games on a width x height board. Game g draws
+ * food from stream g of seed, so a batch is reproducible as a whole.
+ */
+void init_batch(BatchGames& batch, int count, int width, int height, uint64_t seed) {
+    batch.count = count;
+    batch.width = width;
+    batch.height = height;
+    batch.cells = width * height;
+    
+    batch.head_x.assign(count, 0);
+    batch.head_y.assign(count, 0);
+    batch.ring_head.assign(count, 0);
+    batch.length.assign(count, 0);
+    batch.direction.assign(count, 0);
+    batch.next_x.assign(count, 0);
+    batch.next_y.assign(count, 0);
+    batch.move_flags.assign(count, 0);
+    batch.food_x.assign(count, 0);
+    batch.food_y.assign(count, 0);
+    batch.score.assign(count, 0);
+    batch.done.assign(count, 0);
+    batch.final_score.assign(count, 0);
+    batch.free_count.assign(count, 0);
+    batch.rng.resize(count);
+    for (int g = 0; g < count; g++) batch.rng[g].reseed(seed, g);
+    
+    size_t slab = static_cast<size_t>(count) * batch.cells;
+    batch.body.assign(slab, 0);
+    batch.occupied.assign(slab + 3, 0);
+    batch.free_cells.assign(slab, 0);
+    batch.free_pos.assign(slab, FreeCells::NEVER);
+    batch.games_finished = 0;
+    batch.kernel = move_kernels(count, batch.cells)[0];
+    
+    // Every game starts from the same full free-cell set
+    for (int g = 0; g < count; g++) {
+        size_t base = static_cast<size_t>(g) * batch.cells;
+        for (int y = 2; y <= height - 3; y++) {
+            for (int x = 2; x <= width - 3; x++) {
+                int cell = y * width + x;
+                batch.free_pos[base + cell] = batch.free_count[g];
+                batch.free_cells[base + batch.free_count[g]++] = cell;
+            }
+        }
+        reset_batch_game(batch, g);
+    }
+}
+
+/**
+ * Advance every game one tick. actions[g] is a w/a/s/d turn for game g, or
+ * 0 to keep going straight. Games that die or fill the board get done set,
+ * their score copied to final_score, and are reset in place.
+ */
+void step_batch(BatchGames& batch, const char* actions) {
+    batch.kernel->run(batch, actions);
+    
+    const int cells = batch.cells;
+    for (int g = 0; g < batch.count; g++) {
+        size_t base = static_cast<size_t>(g) * cells;
+        int flags = batch.move_flags[g];
+        batch.done[g] = 0;
+        
+        bool dead = (flags & (MOVE_WALL | MOVE_SELF)) != 0;
+        bool won = false;
+        
+        if (!dead) {
+            int x = batch.next_x[g];
+            int y = batch.next_y[g];
+            int cell = y * batch.width + x;
+            int slot = (batch.ring_head[g] == 0 ? cells : batch.ring_head[g]) - 1;
+            batch.ring_head[g] = slot;
+            batch.body[base + slot] = cell;
+            batch.length[g]++;
+            batch_occupy(batch, g, cell);
+            batch.head_x[g] = x;
+            batch.head_y[g] = y;
+            
+            if (flags & MOVE_FOOD) {
+                batch.score[g] += 10;
+                won = !spawn_batch_food(batch, g);
+            } else {
+                int tail_slot = slot + batch.length[g] - 1;
+                if (tail_slot >= cells) tail_slot -= cells;
+                batch_vacate(batch, g, batch.body[base + tail_slot]);
+                batch.length[g]--;
+            }
+        }
+        
+        if (dead || won) {
+            batch.done[g] = 1;
+            batch.final_score[g] = batch.score[g];
+            batch.games_finished++;
+            reset_batch_game(batch, g);
+        }
+    }
+}
+
+/**
+ * Recording and replay
+ *
+ * A game is fully determined by its board size, the seed passed to
+ * reset_game(), and the direction moved on every tick. A recording
+ * stores exactly that, two bits per tick, plus the final score so a replay
+ * can check it reproduced the game.
+ *
+ * File layout (little-endian): "SNKR", version byte, width u16, height u16,
+ * seed u32, ticks u32, final score u32, then the directions packed four to
+ * a byte, first tick in the low bits.
+ */
+const char RECORDING_MAGIC[4] = {'S', 'N', 'K', 'R'};
+const unsigned char RECORDING_VERSION = 2;   // 1 was seeded through srand()
+const char DIRECTION_KEYS[4] = {'w', 'd', 's', 'a'};   // By direction code
+
+struct GameRecording {
+    int width = 0;
+    int height = 0;
+    unsigned int seed = 0;
+    unsigned int ticks = 0;
+    int final_score = 0;
+    vector<unsigned char> moves;   // Packed direction codes
+
+    void start(int board_width, int board_height, unsigned int game_seed) {
+        width = board_width;
+        height = board_height;
+        seed = game_seed;
+        ticks = 0;
+        final_score = 0;
+        moves.clear();
+    }
+
+    void add_tick(char direction) {
+        if (ticks % 4 == 0) moves.push_back(0);
+        moves.back() |= static_cast<unsigned char>(direction_code(direction) << (ticks % 4 * 2));
+        ticks++;
+    }
+
+    char move(unsigned int tick) const {
+        return DIRECTION_KEYS[(moves[tick / 4] >> (tick % 4 * 2)) & 3];
+    }
+};
+
+inline void put_le(vector<unsigned char>& out, unsigned int value, int bytes) {
+    for (int i = 0; i < bytes; i++) out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+}
+
+inline unsigned int get_le(const unsigned char* in, int bytes) {
+    unsigned int value = 0;
+    for (int i = 0; i < bytes; i++) value |= static_cast<unsigned int>(in[i]) << (8 * i);
+    return value;
+}
+
+/**
+ * Write a recording to disk. Returns false if the file can't be written.
+ */
+bool save_recording(const GameRecording& rec, const string& path) {
+    vector<unsigned char> bytes(RECORDING_MAGIC, RECORDING_MAGIC + 4);
+    bytes.push_back(RECORDING_VERSION);
+    put_le(bytes, rec.width, 2);
+    put_le(bytes, rec.height, 2);
+    put_le(bytes, rec.seed, 4);
+    put_le(bytes, rec.ticks, 4);
+    put_le(bytes, rec.final_score, 4);
+    bytes.insert(bytes.end(), rec.moves.begin(), rec.moves.end());
+    
+    ofstream out(path.c_str(), ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return static_cast<bool>(out);
+}
+
+/**
+ * Read a recording from disk. Returns false if it is missing or malformed.
+ */
+bool load_recording(GameRecording& rec, const string& path) {
+    ifstream in(path.c_str(), ios::binary);
+    vector<unsigned char> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    const size_t header = 4 + 1 + 2 + 2 + 4 + 4 + 4;
+    if (bytes.size() < header || memcmp(bytes.data(), RECORDING_MAGIC, 4) != 0 ||
+        bytes[4] != RECORDING_VERSION) {
+        return false;
+    }
+    
+    rec.width = static_cast<int>(get_le(&bytes[5], 2));
+    rec.height = static_cast<int>(get_le(&bytes[7], 2));
+    rec.seed = get_le(&bytes[9], 4);
+    rec.ticks = get_le(&bytes[13], 4);
+    rec.final_score = static_cast<int>(get_le(&bytes[17], 4));
+    rec.moves.assign(bytes.begin() + header, bytes.end());
+    return rec.width >= MIN_BOARD_SIZE && rec.width <= MAX_BOARD_SIZE &&
+           rec.height >= MIN_BOARD_SIZE && rec.height <= MAX_BOARD_SIZE &&
+           rec.moves.size() == (static_cast<uint64_t>(rec.ticks) + 3) / 4;
+}
+
+/**
+ * Re-run a recorded game headless. Returns its final score.
+ */
+int replay_recording(const GameRecording& rec, GameState& state) {
+    reset_game(state, rec.seed);
+    for (unsigned int t = 0; t < rec.ticks && !state.game_over; t++) {
+        step(state, rec.move(t));
+    }
+    return state.score;
+}
+
+/**
+ * Snapshots
+ *
+ * A whole game state in a few bytes, for lookahead and rewind: a fixed
+ * header, then the body as the head position plus one 2-bit direction
+ * code per following segment, four to a byte. A length-500 snake fits in
+ * under 200 bytes, so copying a snapshot is a single short memcpy.
+ *
+ * Restoring rebuilds the body, the occupancy grid and the free-cell set.
+ * The free cells come back as the same set but not in the same order, so
+ * food that is already on the board is exact while where the next piece
+ * appears may differ from the original game. Snapshots are for this
+ * process only: the header is stored in native byte order.
+ */
+struct SnapshotHeader {
+    uint64_t rng_state;
+    uint64_t rng_inc;
+    int32_t score;
+    uint32_t length;
+    uint16_t width, height;
+    uint16_t head_x, head_y;
+    uint16_t food_x, food_y;
+    char direction, next_direction;
+    uint8_t game_over, game_won;
+};
+
+struct Snapshot {
+    vector<unsigned char> bytes;   // SnapshotHeader, then the packed body
+};
+
+/**
+ * Encode state into out, reusing out's storage
+ */
+void save_snapshot(const GameState& state, Snapshot& out) {
+    const SnakeBody& snake = state.snake;
+    size_t length = snake.size();
+    
+    SnapshotHeader header;
+    header.rng_state = state.rng.state;
+    header.rng_inc = state.rng.inc;
+    header.score = state.score;
+    header.length = static_cast<uint32_t>(length);
+    header.width = static_cast<uint16_t>(state.width);
+    header.height = static_cast<uint16_t>(state.height);
+    header.head_x = static_cast<uint16_t>(snake[0].x);
+    header.head_y = static_cast<uint16_t>(snake[0].y);
+    header.food_x = static_cast<uint16_t>(state.food.x);
+    header.food_y = static_cast<uint16_t>(state.food.y);
+    header.direction = state.direction;
+    header.next_direction = state.next_direction;
+    header.game_over = state.game_over;
+    header.game_won = state.game_won;
+    
+    out.bytes.resize(sizeof(header) + (length + 2) / 4);
+    memcpy(out.bytes.data(), &header, sizeof(header));
+    
+    // Segment i's code is the step from segment i - 1 to it, looked up by
+    // (dx + 1) + 3 * (dy + 1)
+    static const unsigned char step_code[9] = {0, 0, 0, 3, 0, 1, 0, 2, 0};
+    unsigned char* packed = out.bytes.data() + sizeof(header);
+    Point previous = snake[0];
+    for (size_t i = 1; i < length; i += 4) {
+        unsigned char byte = 0;
+        for (size_t k = 0; k < 4 && i + k < length; k++) {
+            const Point& p = snake[i + k];
+            int code = step_code[(p.x - previous.x + 1) + 3 * (p.y - previous.y + 1)];
+            byte |= static_cast<unsigned char>(code << (2 * k));
+            previous = p;
+        }
+        packed[(i - 1) / 4] = byte;
+    }
+}
+
+/**
+ * Rebuild a live state from a snapshot, resizing it if the board differs.
+ * Returns false, leaving state alone, if the header doesn't describe a
+ * snapshot save_snapshot() could have made.
+ */
+bool restore_snapshot(GameState& state, const Snapshot& in) {
+    SnapshotHeader header;
+    if (in.bytes.size() < sizeof(header)) return false;
+    memcpy(&header, in.bytes.data(), sizeof(header));
+    if (header.length == 0 || in.bytes.size() != sizeof(header) + (header.length + 2) / 4 ||
+        header.width < MIN_BOARD_SIZE || header.width > MAX_BOARD_SIZE ||
+        header.height < MIN_BOARD_SIZE || header.height > MAX_BOARD_SIZE ||
+        header.length > static_cast<uint32_t>(header.width) * header.height) {
+        return false;
+    }
+    
+    // Head and food sit inside the border wall
+    int width = header.width;
+    int height = header.height;
+    if (!on_playfield(header.head_x, header.head_y, width, height) ||
+        !on_playfield(header.food_x, header.food_y, width, height)) {
+        return false;
+    }
+    
+    // Decode the body before touching state, so a segment that leaves the
+    // board or crosses the body can still be rejected. One bit per cell.
+    vector<Point> body(header.length);
+    vector<uint64_t> seen((static_cast<size_t>(width) * height + 63) / 64, 0);
+    const unsigned char* packed = in.bytes.data() + sizeof(header);
+    Point p(header.head_x, header.head_y);
+    for (uint32_t i = 0; i < header.length; i++) {
+        if (i > 0) {
+            int code = (packed[(i - 1) / 4] >> ((i - 1) % 4 * 2)) & 3;
+            p.x += DIR_DX[code];
+            p.y += DIR_DY[code];
+            if (!on_playfield(p.x, p.y, width, height)) return false;
+        }
+        size_t cell = static_cast<size_t>(p.y) * width + p.x;
+        uint64_t bit = uint64_t(1) << (cell % 64);
+        if (seen[cell / 64] & bit) return false;
+        seen[cell / 64] |= bit;
+        body[i] = p;
+    }
+    
+    if (state.width != width || state.height != height) {
+        state = GameState(width, height);
+    } else {
+        // Same board: hand the old body's cells back, O(length) not O(area)
+        while (state.snake.size() > 0) {
+            const Point& tail = state.snake.back();
+            int cell = tail.y * state.width + tail.x;
+            state.snake.pop_back(cell);
+            state.free_cells.add(cell);
+        }
+    }
+    
+    for (uint32_t i = 0; i < header.length; i++) {
+        int cell = body[i].y * width + body[i].x;
+        state.snake.push_back(body[i], cell);
+        state.free_cells.remove(cell);
+    }
+    
+    state.rng.state = header.rng_state;
+    state.rng.inc = header.rng_inc;
+    state.score = header.score;
+    state.food = Point(header.food_x, header.food_y);
+    state.direction = header.direction;
+    state.next_direction = header.next_direction;
+    state.game_over = header.game_over != 0;
+    state.game_won = header.game_won != 0;
+    return true;
+}
+
+/**
+ * Bots
+ *
+ * Stand-ins for a human player when games run headless. Each returns the
+ * key to pass to step() for the coming tick.
+ */
+enum Policy {
+    POLICY_RANDOM,     // Any direction that doesn't die on the spot
+    POLICY_GREEDY,     // Straight for the food, dodging immediate death
+    POLICY_AUTOPILOT,  // Shortest path to the food (see Autopilot)
+    POLICY_HAMILTON    // Round a Hamiltonian cycle, cutting corners early on
+};
+
+const char* policy_name(Policy policy) {
+    switch (policy) {
+        case POLICY_RANDOM:    return "random";
+        case POLICY_GREEDY:    return "greedy";
+        case POLICY_AUTOPILOT: return "autopilot";
+        default:               return "hamilton";
+    }
+}
+
+/**
+ * Would moving in direction code dir kill the snake this tick?
+ */
+bool move_is_fatal(GameState& state, int dir) {
+    const Point& head = state.snake[0];
+    int x = head.x + DIR_DX[dir];
+    int y = head.y + DIR_DY[dir];
+    return !on_playfield(x, y, state.width, state.height) ||
+           state.snake.occupies(y * state.width + x);
+}
+
+/**
+ * Breadth-first shortest path from the head to the food.
+ *
+ * All search buffers are sized once per board and reused: the queue and
+ * parent array are overwritten as the search goes, and a cell counts as
+ * seen only if its stamp equals the current search's generation, so
+ * nothing is cleared between searches.
+ *
+ * A path, once found, stays valid until the food is eaten: the only cells
+ * the snake newly covers are the ones it walks along the path. So the
+ * search runs once per piece of food and the ticks in between just pop
+ * the next cell.
+ */
+struct Autopilot {
+    int width = 0;
+    int height = 0;
+    vector<int> queue;
+    vector<int> parent;
+    vector<uint32_t> seen;
+    uint32_t generation = 0;
+    vector<int> path;          // Cells still to walk, next one last
+    Point target;              // Food the path leads to
+
+    void resize(int board_width, int board_height) {
+        width = board_width;
+        height = board_height;
+        queue.resize(width * height);
+        parent.resize(width * height);
+        seen.assign(width * height, 0);
+        generation = 0;
+        path.clear();
+        path.reserve(width * height);
+    }
+
+    uint32_t next_generation() {
+        if (++generation == 0) {
+            // Stamps wrapped: clear once every 4 billion searches
+            fill(seen.begin(), seen.end(), 0u);
+            generation = 1;
+        }
+        return generation;
+    }
+};
+
+/**
+ * Breadth-first search from start over cells inside the border and off the
+ * snake, until goal is taken off the queue (-1 to search everything) or
+ * limit cells have been queued. Cells reached carry the current generation
+ * in pilot.seen, and their predecessor in pilot.parent if record_parents is
+ * set. Returns how many cells were queued.
+ */
+int breadth_first(Autopilot& pilot, const GameState& state, int start, int goal, int limit,
+                  bool record_parents) {
+    uint32_t stamp = pilot.next_generation();
+    const int steps[4] = {-pilot.width, 1, pilot.width, -1};
+    int head = 0;
+    int tail = 0;
+    pilot.queue[tail++] = start;
+    pilot.seen[start] = stamp;
+    while (head < tail && tail < limit) {
+        int cell = pilot.queue[head++];
+        if (cell == goal) break;
+        for (int d = 0; d < 4; d++) {
+            int next = cell + steps[d];
+            if (pilot.seen[next] == stamp || state.snake.occupies(next)) continue;
+            // The border ring is never entered, so next stays on the board
+            if (!on_playfield(next % pilot.width, next / pilot.width, pilot.width, pilot.height)) continue;
+            pilot.seen[next] = stamp;
+            if (record_parents) pilot.parent[next] = cell;
+            pilot.queue[tail++] = next;
+        }
+    }
+    return tail;
+}
+
+/**
+ * Cells reachable from start without crossing walls or the snake,
+ * counting no further than limit
+ */
+int reachable_cells(Autopilot& pilot, GameState& state, int start, int limit) {
+    return breadth_first(pilot, state, start, -1, limit, false);
+}
+
+/**
+ * Search for a path from the head to the food and store it in pilot.path.
+ * Returns false if the food can't be reached right now.
+ */
+bool plan_path(Autopilot& pilot, GameState& state) {
+    const Point& head = state.snake[0];
+    int start = head.y * pilot.width + head.x;
+    int goal = state.food.y * pilot.width + state.food.x;
+    
+    pilot.path.clear();
+    breadth_first(pilot, state, start, goal, pilot.width * pilot.height, true);
+    if (pilot.seen[goal] != pilot.generation) return false;
+    for (int at = goal; at != start; at = pilot.parent[at]) pilot.path.push_back(at);
+    pilot.target = state.food;
+    return true;
+}
+
+/**
+ * Autopilot's key for this tick. With no path to the food it heads for
+ * whichever safe neighbour has the most room, to wait for the body to
+ * clear.
+ */
+char autopilot_move(Autopilot& pilot, GameState& state) {
+    if (pilot.width != state.width || pilot.height != state.height) {
+        pilot.resize(state.width, state.height);
+    }
+    
+    const Point& head = state.snake[0];
+    bool on_track = !pilot.path.empty() && pilot.target == state.food;
+    if (on_track) {
+        int next = pilot.path.back();
+        int dx = next % pilot.width - head.x;
+        int dy = next / pilot.width - head.y;
+        on_track = (dx == 0) != (dy == 0) && dx * dx + dy * dy == 1 && !state.snake.occupies(next);
+    }
+    if (!on_track && !plan_path(pilot, state)) {
+        pilot.path.clear();
+        int best_dir = direction_code(state.direction);
+        int best_room = -1;
+        for (int dir = 0; dir < 4; dir++) {
+            if (move_is_fatal(state, dir)) continue;
+            int cell = (head.y + DIR_DY[dir]) * pilot.width + head.x + DIR_DX[dir];
+            int room = reachable_cells(pilot, state, cell, static_cast<int>(state.snake.size()) + 1);
+            if (room > best_room) {
+                best_room = room;
+                best_dir = dir;
+            }
+        }
+        return DIRECTION_KEYS[best_dir];
+    }
+    
+    int next = pilot.path.back();
+    pilot.path.pop_back();
+    int dx = next % pilot.width - head.x;
+    int dy = next / pilot.width - head.y;
+    return dx > 0 ? 'd' : dx < 0 ? 'a' : dy > 0 ? 's' : 'w';
+}
+
+/**
+ * A Hamiltonian cycle of the playable area: every cell visited once, each
+ * next to the one before. A snake that only ever moves along it can never
+ * hit itself, and eventually fills the board.
+ */
+struct HamiltonCycle {
+    int width = 0;
+    int height = 0;
+    vector<Point> order;          // Cells in cycle order
+    vector<int> position;         // Per cell: its index in order
+    vector<char> next_move;       // Per cell: direction to its successor
+};
+
+/**
+ * Column serpentine over x in 1..width-2, y in 2..height-2, closed by a
+ * return path along y = 1; or the same turned on its side when only the
+ * row count allows it. A cycle needs an even number of playable columns
+ * or rows, so with both odd the order is left empty.
+ */
+void build_cycle(HamiltonCycle& cycle, int width, int height) {
+    cycle.width = width;
+    cycle.height = height;
+    cycle.order.clear();
+    cycle.position.assign(width * height, -1);
+    cycle.next_move.assign(width * height, 0);
+    
+    if (width % 2 == 0) {
+        cycle.order.push_back(Point(1, 1));
+        for (int x = 1; x <= width - 2; x++) {
+            for (int i = 2; i <= height - 2; i++) {
+                cycle.order.push_back(Point(x, x % 2 ? i : height - i));
+            }
+        }
+        for (int x = width - 2; x >= 2; x--) {
+            cycle.order.push_back(Point(x, 1));
+        }
+    } else if (height % 2 == 0) {
+        cycle.order.push_back(Point(1, 1));
+        for (int y = 1; y <= height - 2; y++) {
+            for (int i = 2; i <= width - 2; i++) {
+                cycle.order.push_back(Point(y % 2 ? i : width - i, y));
+            }
+        }
+        for (int y = height - 2; y >= 2; y--) {
+            cycle.order.push_back(Point(1, y));
+        }
+    }
+    
+    for (size_t i = 0; i < cycle.order.size(); i++) {
+        const Point& from = cycle.order[i];
+        const Point& to = cycle.order[(i + 1) % cycle.order.size()];
+        char move = to.x > from.x ? 'd' : to.x < from.x ? 'a' : to.y > from.y ? 's' : 'w';
+        cycle.position[from.y * width + from.x] = static_cast<int>(i);
+        cycle.next_move[from.y * width + from.x] = move;
+    }
+}
+
+/**
+ * Per-game state of the Hamiltonian solver
+ */
+struct HamiltonSolver {
+    HamiltonCycle cycle;
+    int aligned = 0;              // Ticks in a row spent moving along the cycle
+};
+
+/**
+ * Hamiltonian solver's key for this tick, from table lookups only.
+ *
+ * Once the body lies in cycle order (it has moved along the cycle for as
+ * many ticks as it is long), it may jump ahead along the cycle toward the
+ * food instead of taking the next cell, as long as it lands short of both
+ * the food and its own tail. The cells it skips stay free behind it, so a
+ * jump is only taken while the free stretch ahead stays larger than all
+ * of the free cells left behind, and not at all past half the board. From
+ * then on it just goes round, which is safe until the board is full.
+ *
+ * Boards with no cycle fall back to the autopilot.
+ */
+char hamilton_move(HamiltonSolver& solver, Autopilot& pilot, GameState& state) {
+    HamiltonCycle& cycle = solver.cycle;
+    if (cycle.width != state.width || cycle.height != state.height) {
+        build_cycle(cycle, state.width, state.height);
+    }
+    if (cycle.order.empty()) return autopilot_move(pilot, state);
+    
+    const Point& head = state.snake[0];
+    const Point& tail = state.snake.back();
+    int n = static_cast<int>(cycle.order.size());
+    int length = static_cast<int>(state.snake.size());
+    int h = cycle.position[head.y * cycle.width + head.x];
+    char move = cycle.next_move[head.y * cycle.width + head.x];
+    
+    if (solver.aligned < length) {
+        // Still getting onto the cycle from the starting position
+        if (!move_is_fatal(state, direction_code(move))) {
+            solver.aligned++;
+            return move;
+        }
+        solver.aligned = 0;
+        for (int dir = 0; dir < 4; dir++) {
+            if (!move_is_fatal(state, dir)) return DIRECTION_KEYS[dir];
+        }
+        return move;
+    }
+    
+    if (2 * length < n) {
+        int to_tail = (cycle.position[tail.y * cycle.width + tail.x] - h + n) % n;
+        int to_food = (cycle.position[state.food.y * cycle.width + state.food.x] - h + n) % n;
+        int free_behind = n - to_tail + 1 - length;
+        int best = 1;
+        for (int dir = 0; dir < 4; dir++) {
+            int x = head.x + DIR_DX[dir];
+            int y = head.y + DIR_DY[dir];
+            int p = cycle.position[y * cycle.width + x];
+            if (p < 0) continue;
+            int jump = (p - h + n) % n;
+            if (jump <= best || jump > to_food || jump >= to_tail) continue;
+            // Ahead after the move: to_tail - jump - 1; behind: grows by jump - 1
+            if (to_tail - jump - 1 <= free_behind + jump - 1) continue;
+            best = jump;
+            move = DIRECTION_KEYS[dir];
+        }
+    }
+    return move;
+}
+
+/**
+ * A headless player: a policy plus whatever state it keeps between ticks
+ */
+struct Bot {
+    Policy policy = POLICY_GREEDY;
+    Rng rng;              // The bot's own, separate from the game's
+    Autopilot pilot;
+    HamiltonSolver solver;
+};
+
+/**
+ * Get a bot ready for a new game
+ */
+void reset_bot(Bot& bot, uint64_t seed) {
+    bot.rng.reseed(seed, 1);
+    bot.pilot.path.clear();
+    bot.solver.aligned = 0;
+}
+
+/**
+ * Pick this tick's key for a bot
+ */
+char choose_move(GameState& state, Bot& bot) {
+    if (bot.policy == POLICY_AUTOPILOT) return autopilot_move(bot.pilot, state);
+    if (bot.policy == POLICY_HAMILTON) return hamilton_move(bot.solver, bot.pilot, state);
+    
+    int current = direction_code(state.direction);
+    const Point& head = state.snake[0];
+    
+    // Candidates: straight and both turns, never the reversal
+    int safe[3];
+    int safe_count = 0;
+    int closer[3];
+    int closer_count = 0;
+    for (int turn = -1; turn <= 1; turn++) {
+        int dir = (current + turn + 4) & 3;
+        if (move_is_fatal(state, dir)) continue;
+        safe[safe_count++] = dir;
+        int dx = state.food.x - head.x;
+        int dy = state.food.y - head.y;
+        if (DIR_DX[dir] * dx > 0 || DIR_DY[dir] * dy > 0) closer[closer_count++] = dir;
+    }
+    
+    if (safe_count == 0) return state.direction;
+    if (bot.policy == POLICY_GREEDY && closer_count > 0) {
+        return DIRECTION_KEYS[closer[bot.rng.below(closer_count)]];
+    }
+    return DIRECTION_KEYS[safe[bot.rng.below(safe_count)]];
+}
+
+/**
+ * Latency statistics
+ *
+ * Histograms with HDR-style buckets: each power of two is split into 16
+ * linear steps, so a value is kept to within about 6% over the whole
+ * range of a 64-bit nanosecond count. Adding a sample is a bit scan and
+ * an increment, cheap enough to leave on for every tick and frame.
+ */
+struct LatencyHistogram {
+    enum { SUB_BITS = 4, BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS };
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t max_value;
+    
+    LatencyHistogram() : counts(), total(0), max_value(0) {}
+    
+    static int bucket_of(uint64_t value) {
+        if (value < (1u << SUB_BITS)) return static_cast<int>(value);
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + static_cast<int>((value >> shift) & ((1 << SUB_BITS) - 1));
+    }
+    
+    /** Largest value that lands in a bucket */
+    static uint64_t bucket_top(int bucket) {
+        if (bucket < (1 << SUB_BITS)) return bucket;
+        int shift = (bucket >> SUB_BITS) - 1;
+        uint64_t low = static_cast<uint64_t>((1 << SUB_BITS) + (bucket & ((1 << SUB_BITS) - 1))) << shift;
+        return low + ((1ULL << shift) - 1);
+    }
+    
+    void add(long long value) {
+        uint64_t v = value > 0 ? static_cast<uint64_t>(value) : 0;
+        counts[bucket_of(v)]++;
+        total++;
+        if (v > max_value) max_value = v;
+    }
+    
+    /** Value at or below which a fraction q of the samples fall */
+    uint64_t percentile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += counts[b];
+            if (seen >= rank) return min(bucket_top(b), max_value);
+        }
+        return max_value;
+    }
+};
+
+// Where interactive time goes
+LatencyHistogram tick_lateness;     // Tick handled vs. when it was due
+LatencyHistogram update_time;       // update_game()
+LatencyHistogram render_time;       // render_game(), present included
+LatencyHistogram present_time;      // present_screen()
+bool show_latency = false;          // L / --latency: overlay under the score
+
+/**
+ * Nanoseconds on a monotonic clock, from an arbitrary epoch
+ */
+inline long long now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Print every histogram to stderr, once the terminal is back to normal
+ */
+void dump_latency() {
+    const LatencyHistogram* histograms[] = {&tick_lateness, &update_time, &render_time, &present_time};
+    const char* names[] = {"tick late", "update", "render", "present"};
+    if (update_time.total == 0 && render_time.total == 0) return;
+    
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    cerr << "latency (us)     count       p50       p90       p99     p99.9       max\n"
+         << fixed << setprecision(1);
+    for (int i = 0; i < 4; i++) {
+        const LatencyHistogram& h = *histograms[i];
+        cerr << left << setw(10) << names[i] << right << setw(12) << h.total;
+        for (int q = 0; q < 4; q++) cerr << setw(10) << h.percentile(quantiles[q]) / 1e3;
+        cerr << setw(10) << h.max_value / 1e3 << "\n";
+    }
+}
+
+// Interactive session
+GameState game;
+int high_score = 0;
+bool game_started = false;
+unsigned long frame_version = 1;   // Bumped whenever what's on screen should change
+string record_path;                 // --record: games are saved to FILE.1, FILE.2, ...
+GameRecording recording;
+unsigned int games_played = 0;
+bool autopilot = false;             // P / --autopilot: the game steers itself
+Autopilot pilot;
+
+// Console buffer for smooth rendering: the board plus five rows of HUD
+int screen_width = 0;
+int screen_height = 0;
+
+/**
+ * Write a decimal number at out and return the end. No locale, no
+ * allocation: the HUD and the frame encoder both format through this.
+ */
+char* write_number(char* out, unsigned long long value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (n > 0) *out++ = digits[--n];
+    return out;
+}
+
+/**
+ * Copy text without its terminator to out and return the end
+ */
+char* write_text(char* out, const char* text) {
+    while (*text) *out++ = *text++;
+    return out;
+}
+
+#ifdef _WIN32
+HANDLE hConsole;
+CHAR_INFO* screen_buffer = NULL;
+COORD buffer_size = {0, 0};
+COORD buffer_coord = {0, 0};
+SMALL_RECT write_region = {0, 0, 0, 0};
+#else
+struct Cell {
+    char ch;
+    unsigned char color;
+};
+
+vector<Cell> screen_buffer;
+vector<Cell> presented;    // What the terminal shows now
+int presented_color = -1;  // Color the terminal will draw in next, -1 if unknown
+string frame_bytes;        // Encoded frame, reused so steady state never allocates
+int output_fd = STDOUT_FILENO;
+termios original_termios;
+#endif
+
+// Layers. Each screen (menu, playing, game over...) has a background
+// composed once per board size: border, help and menu text. A frame draws
+// only the dynamic layer (snake, food, HUD) over the last one, then puts
+// the background back wherever last frame's dynamic layer was and this
+// one's isn't. Cells that end up unchanged are never marked dirty.
+#ifdef _WIN32
+typedef CHAR_INFO ScreenCell;
+#else
+typedef Cell ScreenCell;
+#endif
+enum Layer {
+    LAYER_NONE = -1,
+    LAYER_MENU,
+    LAYER_PLAYING,
+    LAYER_AUTOPILOT,
+    LAYER_WON,
+    LAYER_LOST,
+    LAYER_COUNT
+};
+vector<ScreenCell> backgrounds[LAYER_COUNT];
+int shown_layer = LAYER_NONE;     // Background under the frame being drawn
+vector<int> dynamic_cells;        // Cells the dynamic layer drew this frame
+vector<int> previous_dynamic;     // ...and last frame
+vector<uint32_t> drawn_in;        // Per cell: frame_stamp when last drawn
+uint32_t frame_stamp = 0;
+#ifndef _WIN32
+vector<int> dirty_first;          // Per row: first and last column that may
+vector<int> dirty_last;           // differ from presented; first > last if none
+#endif
+
+#ifndef _WIN32
+/**
+ * Write a whole byte range to the terminal
+ */
+void write_all(const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(output_fd, data, size);
+        if (written <= 0) return;
+        data += written;
+        size -= written;
+    }
+}
+
+/**
+ * Put the terminal back the way we found it
+ */
+void restore_console() {
+    const char teardown[] = "\x1b[0m\x1b[?25h\x1b[?1049l";
+    write_all(teardown, sizeof(teardown) - 1);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios);
+}
+
+/**
+ * SGR escape for a Windows console color attribute
+ */
+const char* sgr_for_color(int color) {
+    switch (color) {
+        case 2:  return "\x1b[0;32m";   // Green
+        case 7:  return "\x1b[0;37m";   // Light gray
+        case 10: return "\x1b[0;92m";   // Bright green
+        case 11: return "\x1b[0;96m";   // Bright cyan
+        case 12: return "\x1b[0;91m";   // Bright red
+        case 14: return "\x1b[0;93m";   // Yellow
+        default: return "\x1b[0;97m";   // Bright white
+    }
+}
+
+/**
+ * Append a non-negative decimal number to the frame
+ */
+void append_number(string& out, int value) {
+    char digits[20];
+    out.append(digits, write_number(digits, value));
+}
+#endif
+
+/**
+ * Size the screen for a board, blank it, and forget what the terminal
+ * shows so the next present_screen() draws everything
+ */
+void reset_screen(int board_width, int board_height) {
+    screen_width = board_width;
+    screen_height = board_height + 5;
+    int cells = screen_width * screen_height;
+#ifdef _WIN32
+    delete[] screen_buffer;
+    screen_buffer = new CHAR_INFO[cells];
+    buffer_size.X = static_cast<SHORT>(screen_width);
+    buffer_size.Y = static_cast<SHORT>(screen_height);
+    write_region.Right = static_cast<SHORT>(screen_width - 1);
+    write_region.Bottom = static_cast<SHORT>(screen_height - 1);
+    for (int i = 0; i < cells; i++) {
+        screen_buffer[i].Char.AsciiChar = ' ';
+        screen_buffer[i].Attributes = 15;
+    }
+#else
+    // The terminal was just cleared, and a blank cell looks the same in any
+    // color, so a full frame only has to send the border and text
+    Cell blank = {' ', 15};
+    screen_buffer.assign(cells, blank);
+    presented.assign(cells, blank);
+    presented_color = -1;
+    frame_bytes.reserve(cells * 16);
+    dirty_first.assign(screen_height, 0);
+    dirty_last.assign(screen_height, screen_width - 1);
+#endif
+    
+    for (int layer = 0; layer < LAYER_COUNT; layer++) backgrounds[layer].clear();
+    shown_layer = LAYER_NONE;
+    dynamic_cells.clear();
+    dynamic_cells.reserve(cells);
+    previous_dynamic.clear();
+    previous_dynamic.reserve(cells);
+    drawn_in.assign(cells, 0);
+    frame_stamp = 0;
+}
+
+/**
+ * Initialize console for smooth rendering
+ */
+void init_console(int board_width, int board_height) {
+#ifdef _WIN32
+    hConsole = CreateConsoleScreenBuffer(
+        GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL
+    );
+    SetConsoleActiveScreenBuffer(hConsole);
+    
+    CONSOLE_CURSOR_INFO cursor_info;
+    GetConsoleCursorInfo(hConsole, &cursor_info);
+    cursor_info.bVisible = FALSE;
+    SetConsoleCursorInfo(hConsole, &cursor_info);
+#else
+    // Raw mode: no line buffering, no echo, non-blocking reads, and Ctrl-C
+    // arrives as a key so the terminal is always restored on the way out
+    tcgetattr(STDIN_FILENO, &original_termios);
+    termios raw = original_termios;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    atexit(restore_console);
+    
+    // Alternate screen, hidden cursor, cleared
+    const char setup[] = "\x1b[?1049h\x1b[?25l\x1b[2J";
+    write_all(setup, sizeof(setup) - 1);
+#endif
+    
+    reset_screen(board_width, board_height);
+}
+
+/**
+ * Note that a cell may no longer match what the terminal shows
+ */
+inline void mark_dirty(int index) {
+#ifndef _WIN32
+    int y = index / screen_width;
+    int x = index - y * screen_width;
+    if (x < dirty_first[y]) dirty_first[y] = x;
+    if (x > dirty_last[y]) dirty_last[y] = x;
+#else
+    (void)index;   // The console takes the whole buffer anyway
+#endif
+}
+
+/**
+ * Store a character at a buffer index known to be on screen. Every write
+ * is part of the dynamic layer, to be put back from the background once
+ * a frame no longer draws it.
+ */
+inline void put_cell(int index, char ch, int color) {
+#ifdef _WIN32
+    CHAR_INFO& cell = screen_buffer[index];
+    if (cell.Char.AsciiChar != ch || cell.Attributes != color) {
+        cell.Char.AsciiChar = ch;
+        cell.Attributes = static_cast<WORD>(color);
+        mark_dirty(index);
+    }
+#else
+    Cell& cell = screen_buffer[index];
+    if (cell.ch != ch || cell.color != color) {
+        cell.ch = ch;
+        cell.color = static_cast<unsigned char>(color);
+        mark_dirty(index);
+    }
+#endif
+    if (drawn_in[index] != frame_stamp) {
+        drawn_in[index] = frame_stamp;
+        dynamic_cells.push_back(index);
+    }
+}
+
+/**
+ * Set character in buffer
+ */
+void set_char(int x, int y, char ch, int color = 15) {
+    if (x >= 0 && x < screen_width && y >= 0 && y < screen_height) {
+        put_cell(y * screen_width + x, ch, color);
+    }
+}
+
+/**
+ * Set string in buffer
+ */
+void set_string(int x, int y, const char* str, int color = 15) {
+    for (int i = 0; str[i] && x + i < screen_width; i++) {
+        set_char(x + i, y, str[i], color);
+    }
+}
+
+/**
+ * Present buffer to screen
+ */
+void present_screen() {
+#ifdef _WIN32
+    WriteConsoleOutput(hConsole, screen_buffer, buffer_size, buffer_coord, &write_region);
+#else
+    // Diff against what the terminal already shows and encode only changed
+    // cells. The color escape is sent only when the color changes, so a
+    // run of same-colored cells costs one byte each. The cursor is moved
+    // only where a run of changes is interrupted, and short gaps of
+    // unchanged cells in the current color are simply written again, as
+    // that is cheaper than a cursor move. Only the dirty span of each row
+    // is looked at, so a frame costs what its dynamic layer drew, not the
+    // size of the screen. The result goes to the terminal in one write().
+    const int max_bridge = 4;   // A cursor move is at least 6 bytes
+    frame_bytes.clear();
+    for (int y = 0; y < screen_height; y++) {
+        int cursor_x = -1;
+        int last = dirty_last[y];
+        for (int x = dirty_first[y]; x <= last; x++) {
+            int index = y * screen_width + x;
+            const Cell& cell = screen_buffer[index];
+            Cell& shown = presented[index];
+            if (cell.ch == shown.ch && cell.color == shown.color) continue;
+            
+            if (cursor_x != x) {
+                int gap = x - cursor_x;
+                bool bridge = cursor_x >= 0 && gap <= max_bridge;
+                for (int i = 0; bridge && i < gap; i++) {
+                    bridge = screen_buffer[index - gap + i].color == presented_color;
+                }
+                if (bridge) {
+                    for (int i = 0; i < gap; i++) frame_bytes += screen_buffer[index - gap + i].ch;
+                } else {
+                    frame_bytes += "\x1b[";
+                    append_number(frame_bytes, y + 1);
+                    frame_bytes += ';';
+                    append_number(frame_bytes, x + 1);
+                    frame_bytes += 'H';
+                }
+            }
+            if (cell.color != presented_color) {
+                frame_bytes += sgr_for_color(cell.color);
+                presented_color = cell.color;
+            }
+            frame_bytes += cell.ch;
+            shown = cell;
+            cursor_x = x + 1;
+        }
+        dirty_first[y] = screen_width;
+        dirty_last[y] = -1;
+    }
+    if (!frame_bytes.empty()) {
+        write_all(frame_bytes.data(), frame_bytes.size());
+    }
+#endif
+}
+
+/**
+ * Initialize game
+ */
+void init_game() {
+    // Seed every game on its own so a recording can reproduce it
+    unsigned int seed = static_cast<unsigned int>(time(0)) * 2654435761u + games_played++;
+    recording.start(game.width, game.height, seed);
+    
+    reset_game(game, seed);
+    game_started = true;
+    frame_version++;
+}
+
+/**
+ * Save the current game under --record as FILE.N, N counting games from 1,
+ * so a restart never overwrites an earlier game
+ */
+void save_game_recording() {
+    if (record_path.empty()) return;
+    recording.final_score = game.score;
+    char suffix[16];
+    char* out = write_number(suffix, games_played);
+    *out = 0;
+    save_recording(recording, record_path + "." + suffix);
+}
+
+/**
+ * Read one pending key press without blocking
+ */
+bool read_key(char& key) {
+#ifdef _WIN32
+    if (!_kbhit()) return false;
+    key = static_cast<char>(tolower(_getch()));
+    return true;
+#else
+    if (read(STDIN_FILENO, &key, 1) != 1) return false;
+    if (key == 3) key = 'q';   // Ctrl-C
+    key = static_cast<char>(tolower(key));
+    return true;
+#endif
+}
+
+/**
+ * Handle every pending key press
+ */
+void handle_input() {
+    char key;
+    while (read_key(key)) {
+        
+        if (key == 'l') {
+            show_latency = !show_latency;
+            frame_version++;
+            continue;
+        }
+        
+        // Quits from any screen, the start menu included
+        if (key == 'q') {
+            if (game_started && !game.game_over) save_game_recording();
+            exit(0);
+        }
+        
+        if (!game_started) {
+            if (key == ' ') {
+                init_game();
+            }
+            continue;
+        }
+        
+        switch (key) {
+            case 'w': 
+            case 's': 
+            case 'a': 
+            case 'd': 
+                if (autopilot) {
+                    autopilot = false;   // Touching the keys takes over
+                    frame_version++;
+                }
+                steer(game, key);
+                break;
+            case 'p':
+                autopilot = !autopilot;
+                frame_version++;
+                break;
+            case 'r':
+            case ' ':
+                if (game.game_over) {
+                    init_game();
+                }
+                break;
+        }
+    }
+}
+
+/**
+ * Update game logic
+ */
+void update_game() {
+    if (!game_started) return;
+    
+    if (autopilot && !game.game_over) steer(game, autopilot_move(pilot, game));
+    StepResult result = step(game, 0);
+    if (result == STEP_IDLE) return;
+    recording.add_tick(game.direction);
+    
+    if (result == STEP_DIED || result == STEP_WON) {
+        if (game.score > high_score) high_score = game.score;
+        save_game_recording();
+    }
+    frame_version++;
+}
+
+/**
+ * Draw snake and food for a board of known type
+ */
+template <class Board>
+void draw_board(const Board& board) {
+    if (game_started && !game.game_over) {
+        // Draw snake
+        size_t length = game.snake.size();
+        for (size_t i = 0; i < length; i++) {
+            const Point& segment = game.snake[i];
+            if (i == 0) {
+                put_cell(segment.y * board.width + segment.x, '@', 10);  // Bright green head
+            } else {
+                put_cell(segment.y * board.width + segment.x, 'o', 2);   // Green body
+            }
+        }
+        
+        // Draw food
+        put_cell(game.food.y * board.width + game.food.x, '*', 12);  // Bright red
+    }
+}
+
+struct DrawOnBoard {
+    typedef void result_type;
+    template <class Board>
+    void operator()(const Board& board) const { draw_board(board); }
+};
+
+/**
+ * The score line, kept formatted and rebuilt only when one of its numbers
+ * changes, so most frames don't format anything
+ */
+struct HudLine {
+    char text[96];
+    int score = -1;
+    size_t length = 0;
+    int high_score = -1;
+};
+HudLine hud;
+
+const char* hud_text() {
+    if (hud.score != game.score || hud.length != game.snake.size() || hud.high_score != high_score) {
+        hud.score = game.score;
+        hud.length = game.snake.size();
+        hud.high_score = high_score;
+        char* out = write_text(hud.text, "SCORE: ");
+        out = write_number(out, hud.score);
+        out = write_text(out, "   LENGTH: ");
+        out = write_number(out, hud.length);
+        out = write_text(out, "   HIGH SCORE: ");
+        out = write_number(out, hud.high_score);
+        *out = 0;
+    }
+    return hud.text;
+}
+
+/**
+ * Write "LABEL p50/p99/max" for a histogram, in microseconds
+ */
+char* write_latency(char* out, const char* label, const LatencyHistogram& h) {
+    out = write_text(out, label);
+    out = write_number(out, h.percentile(0.5) / 1000);
+    *out++ = '/';
+    out = write_number(out, h.percentile(0.99) / 1000);
+    *out++ = '/';
+    return write_number(out, h.max_value / 1000);
+}
+
+/**
+ * Compose every screen's background for the current screen size
+ */
+void build_backgrounds() {
+    int width = screen_width;
+    int height = screen_height - 5;
+    int cells = screen_width * screen_height;
+    
+    for (int layer = 0; layer < LAYER_COUNT; layer++) {
+        for (int i = 0; i < cells; i++) {
+            put_cell(i, ' ', 15);
+        }
+        
+        // Draw beautiful border
+        int bottom = (height - 1) * width;
+        for (int x = 0; x < width; x++) {
+            put_cell(x, '#', 11);  // Cyan
+            put_cell(bottom + x, '#', 11);
+        }
+        for (int y = 0; y < height; y++) {
+            put_cell(y * width, '#', 11);
+            put_cell(y * width + width - 1, '#', 11);
+        }
+        
+        switch (layer) {
+            case LAYER_MENU:
+                set_string(width/2 - 10, height/2 - 2, "PREMIUM SNAKE GAME", 14);
+                set_string(width/2 - 8, height/2, "Press SPACE to Start", 15);
+                set_string(width/2 - 10, height/2 + 2, "WASD = Move, Q = Quit", 7);
+                set_string(width/2 - 10, height/2 + 3, "P = Autopilot", 7);
+                break;
+            case LAYER_PLAYING:
+                set_string(2, height + 2, "WASD = Move   Q = Quit   Premium Snake Game!", 7);
+                break;
+            case LAYER_AUTOPILOT:
+                set_string(2, height + 2, "AUTOPILOT    WASD or P = Take over   Q = Quit", 14);
+                break;
+            case LAYER_WON:
+                set_string(width/2 - 4, height/2 - 1, "YOU WIN!", 10);
+                set_string(width/2 - 12, height/2 + 1, "Press SPACE or R to restart", 15);
+                break;
+            case LAYER_LOST:
+                set_string(width/2 - 5, height/2 - 1, "GAME OVER!", 12);
+                set_string(width/2 - 12, height/2 + 1, "Press SPACE or R to restart", 15);
+                break;
+        }
+        backgrounds[layer].assign(&screen_buffer[0], &screen_buffer[0] + cells);
+    }
+    shown_layer = LAYER_NONE;
+    dynamic_cells.clear();
+}
+
+/**
+ * Start a frame on a background. A different screen's background is
+ * block-copied in whole; the same one is left in place under last
+ * frame's dynamic layer, which end_frame() tidies up.
+ */
+void begin_frame(int layer) {
+    frame_stamp++;
+    if (layer != shown_layer) {
+        const vector<ScreenCell>& background = backgrounds[layer];
+        copy(background.begin(), background.end(), &screen_buffer[0]);
+#ifndef _WIN32
+        dirty_first.assign(screen_height, 0);
+        dirty_last.assign(screen_height, screen_width - 1);
+#endif
+        shown_layer = layer;
+        dynamic_cells.clear();
+    }
+    previous_dynamic.swap(dynamic_cells);
+    dynamic_cells.clear();
+}
+
+/**
+ * Put the background back under whatever last frame drew and this one
+ * didn't
+ */
+void end_frame() {
+    const vector<ScreenCell>& background = backgrounds[shown_layer];
+    for (size_t i = 0; i < previous_dynamic.size(); i++) {
+        int index = previous_dynamic[i];
+        if (drawn_in[index] == frame_stamp) continue;
+        screen_buffer[index] = background[index];
+        mark_dirty(index);
+    }
+}
+
+/**
+ * Render game
+ */
+void render_game() {
+    if (backgrounds[0].empty()) build_backgrounds();
+    
+    int layer = LAYER_PLAYING;
+    if (!game_started) {
+        layer = LAYER_MENU;
+    } else if (game.game_over) {
+        layer = game.game_won ? LAYER_WON : LAYER_LOST;
+    } else if (autopilot) {
+        layer = LAYER_AUTOPILOT;
+    }
+    begin_frame(layer);
+    
+    with_board(game.width, game.height, DrawOnBoard());
+    
+    // Game info
+    int height = game.height;
+    set_string(2, height + 1, hud_text(), 15);
+    
+    if (show_latency) {
+        // Changes every tick, so formatted every frame, still without allocating
+        // T tick late, U update, R render, P present; short labels keep
+        // each row inside the default 50-column board
+        char line[128];
+        char* out = write_latency(line, "us p50/p99/max  T ", tick_lateness);
+        out = write_latency(out, "  U ", update_time);
+        *out = 0;
+        set_string(2, height + 3, line, 7);
+        out = write_latency(line, "R ", render_time);
+        out = write_latency(out, "  P ", present_time);
+        *out = 0;
+        set_string(2, height + 4, line, 7);
+    }
+    end_frame();
+    
+    long long t0 = now_ns();
+    present_screen();
+    present_time.add(now_ns() - t0);
+}
+
+/**
+ * Benchmarks (snake --bench)
+ *
+ * Drives the engine and renderer without a terminal and prints one JSON
+ * document to stdout. The snake is laid along a Hamiltonian cycle of the
+ * playable area and steered around it, so any length from 3 to nearly the
+ * whole board can run for as long as a measurement needs.
+ */
+
+/**
+ * Lay a snake of the given length along the cycle. The free stretch ahead
+ * of the head starts in column 2, so food always has somewhere to go.
+ */
+template <class State>
+void build_bench_state(State& state, const HamiltonCycle& cycle, int length) {
+    reset_game(state, 12345);
+    state.snake.clear();
+    state.free_cells.reset(state.width, state.height);
+    
+    int n = static_cast<int>(cycle.order.size());
+    int head = state.height - 3;   // Last cell of column 1
+    for (int i = 0; i < length; i++) {
+        const Point& segment = cycle.order[((head - i) % n + n) % n];
+        int cell = segment.y * state.width + segment.x;
+        state.snake.push_back(segment, cell);
+        state.free_cells.remove(cell);
+    }
+    
+    const Point& p = cycle.order[head];
+    state.direction = state.next_direction = cycle.order[(head + n - 1) % n].y < p.y ? 's' : 'w';
+    spawn_food(state, DynamicBoard(state.width, state.height));
+}
+
+/**
+ * Move the cycle dictates for the current head
+ */
+template <class State>
+inline char bench_move(State& state, const HamiltonCycle& cycle) {
+    const Point& head = state.snake.front();
+    return cycle.next_move[head.y * cycle.width + head.x];
+}
 
-// Game state
-struct Point {
-    int x, y;
-    Point(int x = 0, int y = 0) : x(x), y(y) {}
-    bool operator==(const Point& other) const {
-        return x == other.x && y == other.y;
+/**
+ * ns per update_game() tick at a given snake length
+ */
+double bench_update(const HamiltonCycle& cycle, int width, int height, int length, long long ticks) {
+    GameState start(width, height);
+    GameState state(width, height);
+    build_bench_state(start, cycle, length);
+    
+    // Restart from the same position every chunk so the length stays put
+    const int chunk = max(1024, width * height);
+    long long done = 0;
+    long long elapsed = 0;
+    while (done < ticks) {
+        state = start;
+        long long t0 = now_ns();
+        int i = 0;
+        for (; i < chunk && !state.game_over; i++) {
+            step(state, bench_move(state, cycle));
+        }
+        elapsed += now_ns() - t0;
+        done += i;
     }
-};
+    return static_cast<double>(elapsed) / done;
+}
 
-vector<Point> snake;
-Point food;
-int score = 0;
-int high_score = 0;
-char direction = 'w';
-char next_direction = 'w';
-bool game_over = false;
-bool game_started = false;
+/**
+ * ns per spawn_food() call at a given snake length
+ */
+double bench_spawn(const HamiltonCycle& cycle, int width, int height, int length, long long calls) {
+    GameState state(width, height);
+    build_bench_state(state, cycle, length);
+    
+    long long checksum = 0;
+    long long t0 = now_ns();
+    for (long long i = 0; i < calls; i++) {
+        spawn_food(state);
+        checksum += state.food.x;
+    }
+    long long elapsed = now_ns() - t0;
+    if (checksum < 0) cerr << checksum;   // Keep the loop observable
+    return static_cast<double>(elapsed) / calls;
+}
 
-// Console buffer for smooth rendering
-#ifdef _WIN32
-HANDLE hConsole;
-CHAR_INFO* screen_buffer;
-COORD buffer_size = {WIDTH, HEIGHT + 5};
-COORD buffer_coord = {0, 0};
-SMALL_RECT write_region = {0, 0, WIDTH - 1, HEIGHT + 4};
+#ifndef _WIN32
+/**
+ * ns and bytes per render_game() + present_screen() frame while playing.
+ * full_bytes is the cost of the first, full redraw.
+ */
+void bench_render(const HamiltonCycle& cycle, int width, int height, int length, int frames,
+                  double& ns_per_frame, double& bytes_per_frame, size_t& full_bytes) {
+    game = GameState(width, height);
+    build_bench_state(game, cycle, length);
+    game_started = true;
+    reset_screen(width, height);
+    render_game();
+    full_bytes = frame_bytes.size();
+    
+    long long elapsed = 0;
+    long long bytes = 0;
+    for (int i = 0; i < frames; i++) {
+        if (game.game_over) build_bench_state(game, cycle, length);
+        step(game, bench_move(game, cycle));
+        long long t0 = now_ns();
+        render_game();
+        elapsed += now_ns() - t0;
+        bytes += frame_bytes.size();
+    }
+    ns_per_frame = static_cast<double>(elapsed) / frames;
+    bytes_per_frame = static_cast<double>(bytes) / frames;
+}
 #endif
 
 /**
- * Initialize console for smooth rendering
+ * ns per game per step_batch() tick for a batch of games taking random
+ * actions
  */
-void init_console() {
-#ifdef _WIN32
-    hConsole = CreateConsoleScreenBuffer(
-        GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL
-    );
-    SetConsoleActiveScreenBuffer(hConsole);
-    
-    CONSOLE_CURSOR_INFO cursor_info;
-    GetConsoleCursorInfo(hConsole, &cursor_info);
-    cursor_info.bVisible = FALSE;
-    SetConsoleCursorInfo(hConsole, &cursor_info);
+double bench_batch(int games, int width, int height, const MoveKernel* kernel,
+                   long long game_ticks) {
+    BatchGames batch;
+    init_batch(batch, games, width, height, 12345);
+    batch.kernel = kernel;
     
-    screen_buffer = new CHAR_INFO[buffer_size.X * buffer_size.Y];
+    // Random actions drawn up front so the policy costs nothing
+    const int pool_size = 1 << 16;
+    vector<char> pool(pool_size + games);
+    const char keys[] = {'w', 'a', 's', 'd', 0, 0, 0, 0};
+    Rng rng(99);
+    for (size_t i = 0; i < pool.size(); i++) pool[i] = keys[rng.below(8)];
     
-    for (int i = 0; i < buffer_size.X * buffer_size.Y; i++) {
-        screen_buffer[i].Char.AsciiChar = ' ';
-        screen_buffer[i].Attributes = 15;
+    long long ticks = max(1LL, game_ticks / games);
+    long long t0 = now_ns();
+    for (long long t = 0; t < ticks; t++) {
+        step_batch(batch, &pool[(t * 7919) % pool_size]);
     }
-#endif
+    long long elapsed = now_ns() - t0;
+    return static_cast<double>(elapsed) / (ticks * games);
 }
 
 /**
- * Set character in buffer
+ * Autopilot ticks per second, decision and step together, over back to
+ * back games on one board
  */
-void set_char(int x, int y, char ch, int color = 15) {
-#ifdef _WIN32
-    if (x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT + 5) {
-        int index = y * buffer_size.X + x;
-        screen_buffer[index].Char.AsciiChar = ch;
-        screen_buffer[index].Attributes = color;
+double bench_autopilot(int width, int height, long long ticks) {
+    GameState state(width, height);
+    Bot bot;
+    bot.policy = POLICY_AUTOPILOT;
+    reset_game(state, 12345);
+    
+    long long t0 = now_ns();
+    for (long long t = 0; t < ticks; t++) {
+        StepResult result = step(state, choose_move(state, bot));
+        if (result == STEP_DIED || result == STEP_WON) reset_game(state, 12345 + t);
     }
-#endif
+    long long elapsed = now_ns() - t0;
+    return ticks * 1e9 / elapsed;
 }
 
 /**
- * Set string in buffer
+ * ns per tick over one game the Hamiltonian solver plays from the start to
+ * a full board, the engine's worst case: the snake ends as long as the
+ * board allows and spawn_food runs with almost nothing left to pick from
  */
-void set_string(int x, int y, const string& str, int color = 15) {
-    for (size_t i = 0; i < str.length() && x + i < WIDTH; i++) {
-        set_char(x + i, y, str[i], color);
+double bench_hamilton(int width, int height, long long& ticks) {
+    GameState state(width, height);
+    Bot bot;
+    bot.policy = POLICY_HAMILTON;
+    reset_game(state, 12345);
+    reset_bot(bot, 12345);
+    
+    ticks = 0;
+    long long t0 = now_ns();
+    while (!state.game_over) {
+        step(state, choose_move(state, bot));
+        ticks++;
     }
+    long long elapsed = now_ns() - t0;
+    return static_cast<double>(elapsed) / ticks;
 }
 
 /**
- * Present buffer to screen
+ * A search workload: generations of clones of one state, each expanded by
+ * a step, then all thrown away. Reports ns per clone, and heap allocations
+ * per clone taken from the counters, with and without an arena.
  */
-void present_screen() {
-#ifdef _WIN32
-    WriteConsoleOutput(hConsole, screen_buffer, buffer_size, buffer_coord, &write_region);
-#endif
+void bench_clones(const HamiltonCycle& cycle, int width, int height, int clones, int generations,
+                  bool use_arena, double& ns_per_clone, double& heap_per_clone, Arena& arena) {
+    GameState root(width, height);
+    build_bench_state(root, cycle, (width - 2) * (height - 2) / 2);
+    vector<GameState> heap_clones;
+    heap_clones.reserve(clones);
+    
+    uint64_t heap_before = heap_allocations.load();
+    long long t0 = now_ns();
+    for (int g = 0; g < generations; g++) {
+        for (int c = 0; c < clones; c++) {
+            GameState* clone;
+            if (use_arena) {
+                void* memory = arena.allocate(sizeof(GameState), alignof(GameState));
+                clone = new (memory) GameState(root, &arena);
+            } else {
+                heap_clones.push_back(root);
+                clone = &heap_clones.back();
+            }
+            step(*clone, DIRECTION_KEYS[c & 3]);
+        }
+        // The whole generation goes at once
+        if (use_arena) {
+            arena.reset();
+        } else {
+            heap_clones.clear();
+        }
+    }
+    long long elapsed = now_ns() - t0;
+    ns_per_clone = static_cast<double>(elapsed) / (static_cast<double>(clones) * generations);
+    heap_per_clone = static_cast<double>(heap_allocations.load() - heap_before) /
+                     (static_cast<double>(clones) * generations);
 }
 
 /**
- * Clear buffer
+ * ns per save_snapshot(), per clone of a saved snapshot (a fresh copy,
+ * allocation included) and per restore_snapshot(), at a given length
  */
-void clear_buffer() {
-#ifdef _WIN32
-    for (int i = 0; i < buffer_size.X * buffer_size.Y; i++) {
-        screen_buffer[i].Char.AsciiChar = ' ';
-        screen_buffer[i].Attributes = 15;
+void bench_snapshot(const HamiltonCycle& cycle, int width, int height, int length,
+                    double& ns_per_save, double& ns_per_clone, double& ns_per_restore,
+                    size_t& bytes) {
+    GameState state(width, height);
+    build_bench_state(state, cycle, length);
+    Snapshot snapshot;
+    const int saves = 200000;
+    long long t0 = now_ns();
+    for (int i = 0; i < saves; i++) {
+        save_snapshot(state, snapshot);
     }
-#endif
+    ns_per_save = static_cast<double>(now_ns() - t0) / saves;
+    bytes = snapshot.bytes.size();
+    
+    // Clones are kept a batch at a time, as a search would
+    const int batch = 1024;
+    const int batches = 1000;
+    vector<Snapshot> clones;
+    clones.reserve(batch);
+    t0 = now_ns();
+    for (int b = 0; b < batches; b++) {
+        for (int i = 0; i < batch; i++) clones.push_back(snapshot);
+        clones.clear();
+    }
+    ns_per_clone = static_cast<double>(now_ns() - t0) / (static_cast<double>(batch) * batches);
+    
+    GameState restored(width, height);
+    const int restores = 20000;
+    t0 = now_ns();
+    for (int i = 0; i < restores; i++) {
+        restore_snapshot(restored, snapshot);
+    }
+    ns_per_restore = static_cast<double>(now_ns() - t0) / restores;
 }
 
 /**
- * Spawn food
+ * Bytes a game state holds for its board
  */
-void spawn_food() {
-    do {
-        food.x = rand() % (WIDTH - 4) + 2;
-        food.y = rand() % (HEIGHT - 4) + 2;
-    } while (find(snake.begin(), snake.end(), food) != snake.end());
+size_t state_bytes(const GameState& state) {
+    return state.snake.cells.capacity() * sizeof(Point) + state.snake.occupied.capacity()
+         + (state.free_cells.cells.capacity() + state.free_cells.position.capacity()) * sizeof(int);
+}
+
+size_t state_bytes(const PackedGameState& state) {
+    return (state.snake.links.capacity() + state.snake.occupied.capacity()
+            + state.free_cells.bits.capacity()) * sizeof(uint64_t);
 }
 
 /**
- * Initialize game
+ * ns per step() with the snake covering half the board, and the state's
+ * size in bytes. Runs straight on from one position, since copying a big
+ * board would cost more than the ticks; the snake grows by a handful of
+ * segments at most.
  */
-void init_game() {
-    snake.clear();
+template <class State>
+double bench_packed(const HamiltonCycle& cycle, int width, int height, long long ticks,
+                    size_t& bytes) {
+    State state(width, height);
+    build_bench_state(state, cycle, static_cast<int>(cycle.order.size()) / 2);
+    bytes = state_bytes(state);
+    long long t0 = now_ns();
+    for (long long i = 0; i < ticks; i++) {
+        step(state, bench_move(state, cycle));
+    }
+    return static_cast<double>(now_ns() - t0) / ticks;
+}
+
+/**
+ * Run every benchmark and print the results as JSON
+ */
+int run_bench() {
+    // Widths must be even so the bench cycle exists
+    const int boards[][2] = {{20, 12}, {50, 25}, {100, 50}, {200, 200}, {1000, 1000}};
+    const int board_count = sizeof(boards) / sizeof(boards[0]);
+    const double fills[] = {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99};
+    const int fill_count = sizeof(fills) / sizeof(fills[0]);
+    
+#ifndef _WIN32
+    // Frames go to /dev/null; only their size is interesting here
+    output_fd = open("/dev/null", O_WRONLY);
+#endif
+    
+    cout << "{\n  \"boards\": [";
+    for (int b = 0; b < board_count; b++) {
+        int width = boards[b][0];
+        int height = boards[b][1];
+        HamiltonCycle cycle;
+        build_cycle(cycle, width, height);
+        int playable = static_cast<int>(cycle.order.size());
+        
+        cout << (b ? ",\n" : "\n")
+             << "    {\"width\": " << width << ", \"height\": " << height
+             << ", \"playable_cells\": " << playable << ",\n";
+        
+        for (int section = 0; section < 3; section++) {
+            const char* names[] = {"update_game", "spawn_food", "render_game"};
+            cout << "     \"" << names[section] << "\": [";
+            for (int f = 0; f < fill_count; f++) {
+                int length = max(3, static_cast<int>(fills[f] * playable));
+                cout << (f ? ",\n       " : "\n       ")
+                     << "{\"length\": " << length
+                     << ", \"fill\": " << static_cast<double>(length) / playable;
+                if (section == 0) {
+                    cout << ", \"ns_per_tick\": "
+                         << bench_update(cycle, width, height, length, 2000000);
+                } else if (section == 1) {
+                    cout << ", \"ns_per_call\": "
+                         << bench_spawn(cycle, width, height, length, 2000000);
+                } else {
+#ifndef _WIN32
+                    double ns_per_frame, bytes_per_frame;
+                    size_t full_bytes;
+                    int frames = max(100, 20000000 / (width * height));
+                    bench_render(cycle, width, height, length, frames,
+                                 ns_per_frame, bytes_per_frame, full_bytes);
+                    cout << ", \"ns_per_frame\": " << ns_per_frame
+                         << ", \"bytes_per_frame\": " << bytes_per_frame
+                         << ", \"full_frame_bytes\": " << full_bytes;
+#endif
+                }
+                cout << "}";
+            }
+            cout << "\n     ]" << (section < 2 ? "," : "") << "\n";
+        }
+        cout << "    }";
+    }
+    cout << "\n  ],\n";
     
-    int start_x = WIDTH / 2;
-    int start_y = HEIGHT / 2;
+    const int batch_sizes[] = {1, 64, 1024, 8192};
+    cout << "  \"step_batch\": [";
+    bool first = true;
+    for (int i = 0; i < 4; i++) {
+        vector<const MoveKernel*> kernels = move_kernels(batch_sizes[i], 50 * 25);
+        for (size_t k = 0; k < kernels.size(); k++) {
+            cout << (first ? "\n" : ",\n")
+                 << "    {\"games\": " << batch_sizes[i] << ", \"width\": 50, \"height\": 25"
+                 << ", \"kernel\": \"" << kernels[k]->name << "\""
+                 << ", \"ns_per_game_tick\": "
+                 << bench_batch(batch_sizes[i], 50, 25, kernels[k], 20000000) << "}";
+            first = false;
+        }
+    }
+    cout << "\n  ],\n";
+    
+    cout << "  \"autopilot\": [";
+    for (int b = 1; b < 4; b++) {
+        cout << (b > 1 ? ",\n" : "\n")
+             << "    {\"width\": " << boards[b][0] << ", \"height\": " << boards[b][1]
+             << ", \"ticks_per_sec\": " << bench_autopilot(boards[b][0], boards[b][1], 2000000) << "}";
+    }
+    cout << "\n  ],\n";
     
-    snake.push_back(Point(start_x, start_y));
-    snake.push_back(Point(start_x, start_y + 1));
-    snake.push_back(Point(start_x, start_y + 2));
+    cout << "  \"hamilton\": [";
+    for (int b = 0; b < 3; b++) {
+        long long ticks;
+        double ns_per_tick = bench_hamilton(boards[b][0], boards[b][1], ticks);
+        cout << (b ? ",\n" : "\n")
+             << "    {\"width\": " << boards[b][0] << ", \"height\": " << boards[b][1]
+             << ", \"ticks_to_fill\": " << ticks << ", \"ns_per_tick\": " << ns_per_tick << "}";
+    }
+    cout << "\n  ],\n";
     
-    spawn_food();
+    cout << "  \"clones\": [";
+    for (int b = 0; b < 4; b++) {
+        int width = boards[b][0];
+        int height = boards[b][1];
+        HamiltonCycle cycle;
+        build_cycle(cycle, width, height);
+        int clones = 256;
+        int generations = max(2, 50000000 / (width * height * clones));
+        for (int use_arena = 0; use_arena < 2; use_arena++) {
+            Arena arena;
+            double ns_per_clone, heap_per_clone;
+            bench_clones(cycle, width, height, clones, generations, use_arena != 0,
+                         ns_per_clone, heap_per_clone, arena);
+            cout << (b || use_arena ? ",\n" : "\n")
+                 << "    {\"width\": " << width << ", \"height\": " << height
+                 << ", \"storage\": \"" << (use_arena ? "arena" : "heap") << "\""
+                 << ", \"clones_per_generation\": " << clones << ", \"generations\": " << generations
+                 << ", \"ns_per_clone\": " << ns_per_clone
+                 << ", \"heap_allocations_per_clone\": " << heap_per_clone
+                 << ", \"arena_allocations\": " << arena.allocations
+                 << ", \"arena_block_allocations\": " << arena.block_allocations
+                 << ", \"arena_resets\": " << arena.resets << "}";
+        }
+    }
+    cout << "\n  ],\n";
     
-    score = 0;
-    direction = 'w';
-    next_direction = 'w';
-    game_over = false;
-    game_started = true;
+    cout << "  \"snapshot\": [";
+    for (int b = 1; b < 4; b++) {
+        int width = boards[b][0];
+        int height = boards[b][1];
+        HamiltonCycle cycle;
+        build_cycle(cycle, width, height);
+        double ns_per_save, ns_per_clone, ns_per_restore;
+        size_t bytes;
+        bench_snapshot(cycle, width, height, 500, ns_per_save, ns_per_clone, ns_per_restore, bytes);
+        cout << (b > 1 ? ",\n" : "\n")
+             << "    {\"width\": " << width << ", \"height\": " << height << ", \"length\": 500"
+             << ", \"bytes\": " << bytes << ", \"ns_per_save\": " << ns_per_save
+             << ", \"ns_per_clone\": " << ns_per_clone
+             << ", \"clones_per_sec\": " << 1e9 / ns_per_clone
+             << ", \"ns_per_restore\": " << ns_per_restore << "}";
+    }
+    cout << "\n  ],\n";
+    
+    const int packed_boards[][2] = {{1000, 1000}, {4096, 4096}};
+    cout << "  \"packed\": [";
+    for (int b = 0; b < 2; b++) {
+        int width = packed_boards[b][0];
+        int height = packed_boards[b][1];
+        HamiltonCycle cycle;
+        build_cycle(cycle, width, height);
+        for (int packed = 0; packed < 2; packed++) {
+            size_t bytes;
+            double ns_per_tick = packed
+                ? bench_packed<PackedGameState>(cycle, width, height, 20000000, bytes)
+                : bench_packed<GameState>(cycle, width, height, 20000000, bytes);
+            cout << (b || packed ? ",\n" : "\n")
+                 << "    {\"width\": " << width << ", \"height\": " << height
+                 << ", \"state\": \"" << (packed ? "packed" : "standard") << "\""
+                 << ", \"length\": " << cycle.order.size() / 2
+                 << ", \"bytes\": " << bytes
+                 << ", \"bytes_per_cell\": " << static_cast<double>(bytes) / (width * height)
+                 << ", \"ns_per_tick\": " << ns_per_tick << "}";
+        }
+    }
+    cout << "\n  ]\n}" << endl;
+    return 0;
 }
 
 /**
- * Handle input
+ * Parallel runner (snake --run M)
+ *
+ * Plays M headless games with a bot on every core. Game indices are dealt
+ * out as one contiguous range per worker; a worker takes games from the
+ * front of its own range and, when that runs dry, steals the back half of
+ * another worker's. A range is a single 64-bit atomic (begin in the low
+ * half, end in the high half), so taking and stealing are one CAS each and
+ * nothing ever waits on a lock.
+ *
+ * Each worker has its own GameState, bot generator and statistics; the
+ * statistics are summed once all workers have joined. Game i and its
+ * bot are always seeded from (seed, i), so results don't depend on which
+ * worker ran what.
  */
-void handle_input() {
-#ifdef _WIN32
-    if (_kbhit()) {
-        char key = tolower(_getch());
-        
-        if (!game_started) {
-            if (key == ' ') {
-                init_game();
-            }
-            return;
+struct RunStats {
+    long long games = 0;
+    long long ticks = 0;
+    long long total_score = 0;
+    long long wins = 0;
+    int max_score = 0;
+};
+
+struct RunWorker {
+    atomic<uint64_t> range;
+    RunStats stats;
+    char padding[64];   // Keep neighbouring workers off this cache line
+};
+
+inline uint64_t pack_range(uint32_t begin, uint32_t end) {
+    return static_cast<uint64_t>(end) << 32 | begin;
+}
+
+/**
+ * Take the next game from the front of a worker's own range
+ */
+bool take_game(RunWorker& worker, uint32_t& index) {
+    uint64_t range = worker.range.load();
+    while (true) {
+        uint32_t begin = static_cast<uint32_t>(range);
+        uint32_t end = static_cast<uint32_t>(range >> 32);
+        if (begin >= end) return false;
+        if (worker.range.compare_exchange_weak(range, pack_range(begin + 1, end))) {
+            index = begin;
+            return true;
+        }
+    }
+}
+
+/**
+ * Steal the back half of another worker's range
+ */
+bool steal_games(RunWorker& victim, uint32_t& begin, uint32_t& end) {
+    uint64_t range = victim.range.load();
+    while (true) {
+        uint32_t victim_begin = static_cast<uint32_t>(range);
+        uint32_t victim_end = static_cast<uint32_t>(range >> 32);
+        if (victim_begin >= victim_end) return false;
+        uint32_t split = victim_end - (victim_end - victim_begin + 1) / 2;
+        if (victim.range.compare_exchange_weak(range, pack_range(victim_begin, split))) {
+            begin = split;
+            end = victim_end;
+            return true;
+        }
+    }
+}
+
+/**
+ * Seed for game index of a run, mixed so neighbouring games differ
+ */
+inline uint64_t run_game_seed(uint64_t seed, uint64_t index) {
+    uint64_t z = seed + (index + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Play one game to the end. A game that goes 4 x board area ticks without
+ * eating is stopped, so a circling bot can't stall the run.
+ */
+void play_run_game(GameState& state, uint64_t seed, Bot& bot, RunStats& stats) {
+    reset_game(state, seed);
+    reset_bot(bot, seed);
+    long long stall_limit = 4LL * state.width * state.height;
+    long long since_food = 0;
+    while (!state.game_over && since_food < stall_limit) {
+        StepResult result = step(state, choose_move(state, bot));
+        since_food = result == STEP_ATE ? 0 : since_food + 1;
+        stats.ticks++;
+    }
+    stats.games++;
+    stats.total_score += state.score;
+    if (state.game_won) stats.wins++;
+    if (state.score > stats.max_score) stats.max_score = state.score;
+}
+
+void run_worker(vector<RunWorker>& workers, int id, int width, int height,
+                Policy policy, uint64_t seed) {
+    RunWorker& self = workers[id];
+    GameState state(width, height);
+    Bot bot;
+    bot.policy = policy;
+    int count = static_cast<int>(workers.size());
+    
+    while (true) {
+        uint32_t index;
+        if (take_game(self, index)) {
+            play_run_game(state, run_game_seed(seed, index), bot, self.stats);
+            continue;
         }
         
-        switch (key) {
-            case 'w': 
-                if (direction != 's') next_direction = 'w'; 
-                break;
-            case 's': 
-                if (direction != 'w') next_direction = 's'; 
-                break;
-            case 'a': 
-                if (direction != 'd') next_direction = 'a'; 
-                break;
-            case 'd': 
-                if (direction != 'a') next_direction = 'd'; 
-                break;
-            case 'q': 
-                exit(0);
-                break;
-            case 'r':
-            case ' ':
-                if (game_over) {
-                    init_game();
-                }
-                break;
+        // Own range is empty: try everyone else once, then stop
+        bool stole = false;
+        for (int k = 1; k < count && !stole; k++) {
+            uint32_t begin, end;
+            if (steal_games(workers[(id + k) % count], begin, end)) {
+                self.range.store(pack_range(begin, end));
+                stole = true;
+            }
         }
+        if (!stole) return;
     }
-#endif
 }
 
 /**
- * Update game logic
+ * Play games headless across threads and print the totals as JSON
  */
-void update_game() {
-    if (!game_started || game_over) return;
+int run_games(long long games, int threads, int width, int height, Policy policy, uint64_t seed) {
+    if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
     
-    direction = next_direction;
+    vector<RunWorker> workers(threads);
+    for (int t = 0; t < threads; t++) {
+        uint32_t begin = static_cast<uint32_t>(games * t / threads);
+        uint32_t end = static_cast<uint32_t>(games * (t + 1) / threads);
+        workers[t].range.store(pack_range(begin, end));
+    }
     
-    Point new_head = snake[0];
+    long long t0 = now_ns();
+    vector<thread> pool;
+    for (int t = 0; t < threads; t++) {
+        pool.push_back(thread(run_worker, ref(workers), t, width, height, policy, seed));
+    }
+    for (size_t t = 0; t < pool.size(); t++) pool[t].join();
+    double seconds = (now_ns() - t0) / 1e9;
     
-    switch (direction) {
-        case 'w': new_head.y--; break;
-        case 's': new_head.y++; break;
-        case 'a': new_head.x--; break;
-        case 'd': new_head.x++; break;
+    RunStats total;
+    for (int t = 0; t < threads; t++) {
+        const RunStats& stats = workers[t].stats;
+        total.games += stats.games;
+        total.ticks += stats.ticks;
+        total.total_score += stats.total_score;
+        total.wins += stats.wins;
+        total.max_score = max(total.max_score, stats.max_score);
     }
     
-    if (new_head.x <= 0 || new_head.x >= WIDTH-1 || 
-        new_head.y <= 0 || new_head.y >= HEIGHT-1) {
-        game_over = true;
-        if (score > high_score) high_score = score;
+    cout << "{\"games\": " << total.games << ", \"threads\": " << threads
+         << ", \"width\": " << width << ", \"height\": " << height
+         << ", \"policy\": \"" << policy_name(policy) << "\""
+         << ", \"seed\": " << seed
+         << ",\n \"seconds\": " << seconds
+         << ", \"games_per_sec\": " << total.games / seconds
+         << ", \"ticks_per_sec\": " << total.ticks / seconds
+         << ",\n \"mean_score\": " << static_cast<double>(total.total_score) / max(1LL, total.games)
+         << ", \"max_score\": " << total.max_score << ", \"wins\": " << total.wins
+         << ",\n \"games_per_thread\": [";
+    for (int t = 0; t < threads; t++) {
+        cout << (t ? ", " : "") << workers[t].stats.games;
+    }
+    cout << "]}" << endl;
+    return 0;
+}
+
+/**
+ * Sleep for a number of milliseconds
+ */
+void sleep_ms(unsigned int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+// Game tick: a fixed timestep on the steady clock. Each tick has an
+// absolute deadline and the next one is exactly TICK_NS after it, however
+// late this one ran, so timing error never adds up. While the tick is
+// stopped (menus, game over) only a key press wakes the main loop.
+const long long TICK_NS = 120 * 1000000LL;
+const int MAX_CATCH_UP_TICKS = 3;   // Beyond this, drop the backlog
+bool ticking = false;
+long long next_tick = 0;            // now_ns() deadline of the next tick
+#ifdef __linux__
+int tick_fd = -1;
+#elif defined(_WIN32)
+HANDLE tick_timer = NULL;
+#endif
+
+/**
+ * Point the OS timer at next_tick, or disarm it when stopped
+ */
+void arm_tick_timer() {
+#ifdef __linux__
+    // steady_clock is CLOCK_MONOTONIC, so the deadline converts directly
+    itimerspec spec = {};
+    if (ticking) {
+        spec.it_value.tv_sec = static_cast<time_t>(next_tick / 1000000000LL);
+        spec.it_value.tv_nsec = static_cast<long>(next_tick % 1000000000LL);
+    }
+    timerfd_settime(tick_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+#elif defined(_WIN32)
+    if (!ticking) {
+        CancelWaitableTimer(tick_timer);
         return;
     }
-    
-    for (const Point& segment : snake) {
-        if (new_head == segment) {
-            game_over = true;
-            if (score > high_score) high_score = score;
-            return;
-        }
+    // Waitable timers take absolute times on the wall clock only, so the
+    // deadline goes in as a relative wait (negative, in 100 ns units)
+    LARGE_INTEGER due;
+    due.QuadPart = -max(0LL, (next_tick - now_ns()) / 100);
+    SetWaitableTimer(tick_timer, &due, 0, NULL, NULL, FALSE);
+#endif
+}
+
+/**
+ * Start or stop the game tick
+ */
+void set_ticking(bool on) {
+#ifdef __linux__
+    if (tick_fd < 0) tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+#elif defined(_WIN32)
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x2
+#endif
+    if (!tick_timer) {
+        // High resolution where the system has it, 15.6 ms steps otherwise
+        tick_timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                            TIMER_ALL_ACCESS);
+        if (!tick_timer) tick_timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
     }
-    
-    snake.insert(snake.begin(), new_head);
-    
-    if (new_head == food) {
-        score += 10;
-        spawn_food();
-    } else {
-        snake.pop_back();
+#endif
+    ticking = on;
+    next_tick = now_ns() + TICK_NS;
+    arm_tick_timer();
+}
+
+#ifdef _WIN32
+/**
+ * Drop key-up, focus, mouse and resize records, and key presses that
+ * carry no character, from the front of the console input queue. The
+ * input handle stays signaled while any record is queued, and _kbhit()
+ * never consumes these, so without this the wait would return at once
+ * forever after the first key.
+ */
+void discard_non_key_input(HANDLE input) {
+    INPUT_RECORD record;
+    DWORD count;
+    while (PeekConsoleInput(input, &record, 1, &count) && count == 1) {
+        if (record.EventType == KEY_EVENT && record.Event.KeyEvent.bKeyDown &&
+            record.Event.KeyEvent.uChar.AsciiChar != 0) {
+            break;
+        }
+        ReadConsoleInput(input, &record, 1, &count);
     }
 }
+#endif
 
 /**
- * Render game
+ * Block until a key is pending or a tick is due.
+ * Returns how many ticks to run now: normally 0 or 1. After a stall (a
+ * slow frame, the process stopped) the missed ticks run back to back, up
+ * to MAX_CATCH_UP_TICKS; anything older is dropped and the schedule starts
+ * over from now rather than racing the snake forward.
  */
-void render_game() {
-    clear_buffer();
-    
-    // Draw beautiful border
-    for (int x = 0; x < WIDTH; x++) {
-        set_char(x, 0, '#', 11);  // Cyan
-        set_char(x, HEIGHT-1, '#', 11);
+int wait_for_event() {
+#ifdef __linux__
+    pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {tick_fd, POLLIN, 0}};
+    poll(fds, 2, -1);
+    if (fds[1].revents & POLLIN) {
+        uint64_t expirations;
+        if (read(tick_fd, &expirations, sizeof(expirations)) < 0) return 0;
     }
-    for (int y = 0; y < HEIGHT; y++) {
-        set_char(0, y, '#', 11);
-        set_char(WIDTH-1, y, '#', 11);
+#elif defined(_WIN32)
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    discard_non_key_input(input);
+    HANDLE handles[2] = {input, tick_timer};
+    WaitForMultipleObjects(ticking ? 2 : 1, handles, FALSE, INFINITE);
+#else
+    // poll() only counts milliseconds: wait out whole ones, then sleep the
+    // rest of the way to the deadline
+    int timeout = -1;
+    if (ticking) {
+        long long remaining = next_tick - now_ns();
+        timeout = remaining > 1000000 ? static_cast<int>(remaining / 1000000) : 0;
     }
-    
-    if (game_started && !game_over) {
-        // Draw snake
-        for (size_t i = 0; i < snake.size(); i++) {
-            Point& segment = snake[i];
-            if (i == 0) {
-                set_char(segment.x, segment.y, '@', 10);  // Bright green head
-            } else {
-                set_char(segment.x, segment.y, 'o', 2);   // Green body
-            }
+    pollfd fds[1] = {{STDIN_FILENO, POLLIN, 0}};
+    if (poll(fds, 1, timeout) == 0 && ticking) {
+        long long remaining = next_tick - now_ns();
+        if (remaining > 0) {
+            timespec rest = {0, static_cast<long>(remaining)};
+            nanosleep(&rest, NULL);
         }
-        
-        // Draw food
-        set_char(food.x, food.y, '*', 12);  // Bright red
     }
+#endif
+    if (!ticking) return 0;
     
-    // Game info
-    stringstream info;
-    info << "SCORE: " << score << "   LENGTH: " << snake.size() << "   HIGH SCORE: " << high_score;
-    set_string(2, HEIGHT + 1, info.str(), 15);
+    long long now = now_ns();
+    if (now < next_tick) {
+        arm_tick_timer();   // Woken early: make sure the timer is still set
+        return 0;
+    }
     
-    if (!game_started) {
-        set_string(WIDTH/2 - 10, HEIGHT/2 - 2, "PREMIUM SNAKE GAME", 14);
-        set_string(WIDTH/2 - 8, HEIGHT/2, "Press SPACE to Start", 15);
-        set_string(WIDTH/2 - 10, HEIGHT/2 + 2, "WASD = Move, Q = Quit", 7);
-    } else if (game_over) {
-        set_string(WIDTH/2 - 5, HEIGHT/2 - 1, "GAME OVER!", 12);
-        set_string(WIDTH/2 - 12, HEIGHT/2 + 1, "Press SPACE or R to restart", 15);
-    } else {
-        set_string(2, HEIGHT + 2, "WASD = Move   Q = Quit   Premium Snake Game!", 7);
+    int due = 0;
+    while (next_tick <= now && due < MAX_CATCH_UP_TICKS) {
+        tick_lateness.add(now - next_tick);
+        next_tick += TICK_NS;
+        due++;
+    }
+    if (next_tick <= now) {
+        next_tick = now + TICK_NS;
+    }
+    arm_tick_timer();
+    return due;
+}
+
+/**
+ * Parse a board size given as WxH
+ */
+bool parse_size(const char* text, int& width, int& height) {
+    char x, extra;
+    stringstream in(text);
+    if (!(in >> width >> x >> height) || (x != 'x' && x != 'X') || (in >> extra)) return false;
+    return width >= MIN_BOARD_SIZE && width <= MAX_BOARD_SIZE &&
+           height >= MIN_BOARD_SIZE && height <= MAX_BOARD_SIZE;
+}
+
+/**
+ * Parse a non-negative count no larger than max_value
+ */
+bool parse_count(const char* text, long long max_value, long long& value) {
+    stringstream in(text);
+    char extra;
+    return (in >> value) && !(in >> extra) && value >= 0 && value <= max_value;
+}
+
+/**
+ * Parse a bot policy name
+ */
+bool parse_policy(const char* text, Policy& policy) {
+    string name = text;
+    if (name == "random") policy = POLICY_RANDOM;
+    else if (name == "greedy") policy = POLICY_GREEDY;
+    else if (name == "autopilot") policy = POLICY_AUTOPILOT;
+    else if (name == "hamilton") policy = POLICY_HAMILTON;
+    else return false;
+    return true;
+}
+
+/**
+ * Explain the command line
+ */
+void print_usage(const char* program) {
+    cerr << "usage: " << program << " [--size WxH] [--record FILE] [--autopilot] [--latency]\n"
+         << "       " << program << " --replay FILE\n"
+         << "       " << program << " --run GAMES [--size WxH] [--threads N] [--policy NAME] [--seed S]\n"
+         << "       " << program << " --bench\n"
+         << "  --size WxH      board size, " << MIN_BOARD_SIZE << " to " << MAX_BOARD_SIZE
+         << " per side (default " << DEFAULT_WIDTH << "x" << DEFAULT_HEIGHT << ")\n"
+         << "  --record FILE   save each game's seed and moves to FILE.1, FILE.2, ...\n"
+         << "  --autopilot     start with the autopilot steering (P toggles it)\n"
+         << "  --latency       show tick/update/render timings under the score (L toggles)\n"
+         << "  --replay FILE   re-run a recorded game headless and check its score\n"
+         << "  --run GAMES     play GAMES headless bot games on every core, print JSON\n"
+         << "  --threads N     worker threads for --run (default: all cores)\n"
+         << "  --policy NAME   bot for --run: random, greedy, autopilot\n"
+         << "                  or hamilton (default greedy)\n"
+         << "  --seed S        seed for --run (default: the clock)\n"
+         << "  --bench         run the benchmarks and print JSON\n";
+}
+
+/**
+ * Replay a recording at full speed and report whether the score matched
+ */
+int run_replay(const string& path) {
+    GameRecording rec;
+    if (!load_recording(rec, path)) {
+        cerr << "cannot read recording " << path << endl;
+        return 1;
     }
     
-    present_screen();
+    GameState state(rec.width, rec.height);
+    long long t0 = now_ns();
+    int score = replay_recording(rec, state);
+    double seconds = (now_ns() - t0) / 1e9;
+    
+    cout << "replayed " << rec.ticks << " ticks on " << rec.width << "x" << rec.height
+         << " in " << seconds * 1000 << " ms (" << rec.ticks / seconds / 1e6 << " M ticks/s)\n"
+         << "final score " << score << ", recorded " << rec.final_score
+         << (score == rec.final_score ? ": OK" : ": MISMATCH") << endl;
+    return score == rec.final_score ? 0 : 1;
 }
 
 /**
  * Main game loop
  */
-int main() {
-    srand(static_cast<unsigned int>(time(0)));
+int main(int argc, char** argv) {
+    int width = DEFAULT_WIDTH;
+    int height = DEFAULT_HEIGHT;
+    long long run_count = -1;
+    long long threads = 0;
+    long long seed = static_cast<long long>(time(0));
+    Policy policy = POLICY_GREEDY;
     
-    cout << "Loading Premium Snake Game..." << endl;
-    Sleep(500);
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--bench") {
+            return run_bench();
+        } else if (arg == "--size" && has_value && parse_size(argv[i + 1], width, height)) {
+            i++;
+        } else if (arg == "--autopilot") {
+            autopilot = true;
+        } else if (arg == "--latency") {
+            show_latency = true;
+        } else if (arg == "--record" && has_value) {
+            record_path = argv[++i];
+        } else if (arg == "--replay" && has_value) {
+            return run_replay(argv[i + 1]);
+        } else if (arg == "--run" && has_value && parse_count(argv[i + 1], 0x7fffffff, run_count)) {
+            i++;
+        } else if (arg == "--threads" && has_value && parse_count(argv[i + 1], 4096, threads)) {
+            i++;
+        } else if (arg == "--policy" && has_value && parse_policy(argv[i + 1], policy)) {
+            i++;
+        } else if (arg == "--seed" && has_value && parse_count(argv[i + 1], 0x7fffffffffffffffLL, seed)) {
+            i++;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
     
-    init_console();
+    if (run_count >= 0) {
+        return run_games(run_count, static_cast<int>(threads), width, height, policy, seed);
+    }
+    
+    cout << "Loading Premium Snake Game..." << endl;
+    sleep_ms(500);
     
-    DWORD last_update = GetTickCount();
-    const DWORD frame_time = 120; // Smooth speed
+    game = GameState(width, height);
+    atexit(dump_latency);   // Before init_console, so it runs after the terminal is restored
+    init_console(width, height);
+    set_ticking(false);
     
+    // Sleep until there is a key to handle or a tick to run, and redraw
+    // only when one of them changed something
+    unsigned long rendered_version = 0;
     while (true) {
-        DWORD current_time = GetTickCount();
+        if (frame_version != rendered_version) {
+            long long t0 = now_ns();
+            render_game();
+            render_time.add(now_ns() - t0);
+            rendered_version = frame_version;
+        }
+        
+        int ticks_due = wait_for_event();
         
         handle_input();
         
-        if (current_time - last_update >= frame_time) {
+        for (int i = 0; i < ticks_due; i++) {
+            long long t0 = now_ns();
             update_game();
-            last_update = current_time;
+            update_time.add(now_ns() - t0);
         }
         
-        render_game();
-        Sleep(16); // 60 FPS rendering
+        bool playing = game_started && !game.game_over;
+        if (playing != ticking) {
+            set_ticking(playing);
+        }
     }
     
     return 0;
-}
\ No newline at end of file
+}